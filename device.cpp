@@ -1,12 +1,15 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include "device.h"
 
 std::vector<flashcart_core::Flashcart*> *flashcart_core::flashcart_list = nullptr;
 
 flashcart_core::Flashcart::Flashcart(const char* name, const char* short_name, const size_t max_length)
-    : m_name(name), m_short_name(short_name), m_max_length(max_length) {
+    : m_name(name), m_short_name(short_name), m_max_length(max_length),
+      m_scratch(nullptr), m_scratch_size(0), m_counters(), m_verify{VerifyMode::Full, 0, false}, m_retry{0, 0}, m_journal(0),
+      m_trace(nullptr), m_trace_replay(false), m_trace_index(0), m_backend(nullptr), m_estimate(), m_speed(), m_progress() {
     if (flashcart_list == nullptr) {
         flashcart_list = new std::vector<Flashcart*>();
     }
@@ -15,3 +18,396 @@ flashcart_core::Flashcart::Flashcart(const char* name, const char* short_name, c
 
 flashcart_core::Flashcart::Flashcart(const char* name, const size_t max_length)
     : Flashcart(name, name, max_length) {}
+
+bool flashcart_core::Flashcart::writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer, const VerifyPolicy &policy) {
+    const VerifyPolicy saved = m_verify;
+    m_verify = policy;
+    const bool result = writeFlash(address, length, buffer);
+    m_verify = saved;
+    return result;
+}
+
+bool flashcart_core::Flashcart::injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size, const VerifyPolicy &policy) {
+    const VerifyPolicy saved = m_verify;
+    m_verify = policy;
+    const bool result = injectNtrBoot(blowfish_key, firm, firm_size);
+    m_verify = saved;
+    return result;
+}
+
+uint32_t flashcart_core::Flashcart::getDiffBlocks(uint32_t address, uint32_t length) {
+    uint32_t blocks = 0;
+    for (uint64_t block = address; block < uint64_t(address) + length; ++blocks) {
+        const FlashSector sector = getEraseSector(static_cast<uint32_t>(block));
+        block = uint64_t(sector.start) + sector.size;
+    }
+
+    return blocks;
+}
+
+bool flashcart_core::Flashcart::diff(uint32_t address, uint32_t length, const uint8_t *expected, uint8_t *dirty) {
+    FLASH_SPAN("diff");
+    const uint32_t block_size = getEraseSize();
+    std::memset(dirty, 0, (getDiffBlocks(address, length) + 7) / 8);
+    if (!length) {
+        return true;
+    }
+
+    const bool use_scratch = m_scratch_size >= block_size;
+    uint8_t *const buf = use_scratch ? m_scratch : static_cast<uint8_t *>(std::malloc(block_size));
+    if (!buf) {
+        logMessage(LOG_ERR, "diff: malloc failed");
+        return false;
+    }
+
+    bool result = true;
+    uint32_t n = 0;
+    for (uint32_t block = address; block - address < length; ++n) {
+        const FlashSector sector = getEraseSector(block);
+        if (sector.size > block_size) {
+            logMessage(LOG_ERR, "diff: 0x%X byte sector at 0x%08X is bigger than getEraseSize()", sector.size, sector.start);
+            result = false;
+            break;
+        }
+        if (!readFlash(sector.start, sector.size, buf)) {
+            logMessage(LOG_ERR, "diff: read failed at 0x%08X", sector.start);
+            result = false;
+            break;
+        }
+
+        const uint32_t start = std::max(address, sector.start);
+        const uint32_t end = std::min<uint64_t>(uint64_t(address) + length, uint64_t(sector.start) + sector.size);
+        if (std::memcmp(buf + (start - sector.start), expected + (start - address), end - start)) {
+            dirty[n / 8] |= BIT(n % 8);
+        }
+        block = end;
+    }
+
+    if (!use_scratch) {
+        std::free(buf);
+    }
+    return result;
+}
+
+uint32_t flashcart_core::Flashcart::journalHash(const void *data, size_t size, uint32_t hash) {
+    const uint8_t *const bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+uint32_t flashcart_core::Flashcart::beginJournal(uint32_t id, uint32_t address, uint32_t end) {
+    m_journal = journalHash(m_short_name, std::strlen(m_short_name), id);
+
+    uint32_t resume;
+    if (!platform::loadJournal(m_journal, resume) || resume <= address || resume > end) {
+        return address;
+    }
+
+    logMessage(LOG_NOTICE, "Resuming interrupted write at 0x%08X", resume);
+    return resume;
+}
+
+bool flashcart_core::Flashcart::beginInjectJournal(uint32_t id, uint32_t address, uint32_t length, uint8_t *buffer,
+        uint32_t &resume) {
+    id = journalHash(&length, sizeof(length), journalHash(&address, sizeof(address), id));
+    resume = beginJournal(id, address, address + length);
+    if (platform::loadJournalData(m_journal, buffer, length)) {
+        logMessage(LOG_NOTICE, "Restoring the flash at 0x%08X from before the interrupted inject", address);
+        return true;
+    }
+
+    // the blocks before `resume` are skipped, but the one it stopped in may be half erased
+    if (resume != address) {
+        logMessage(LOG_WARN, "No copy of the flash at 0x%08X from before the interrupted inject, reading it back", resume);
+    }
+    if (!readFlash(address, length, buffer)) {
+        return false;
+    }
+    platform::saveJournalData(m_journal, buffer, length);
+    return true;
+}
+
+uint64_t flashcart_core::Flashcart::estimateDuration(FlashOp op, uint32_t address, uint32_t length) {
+    finishEstimate();
+
+    const CostModel model = getCostModel();
+    uint64_t commands = 0;
+    uint64_t bytes = 0;
+    uint64_t busy = 0;
+    const auto read = [&](uint64_t size) {
+        const uint64_t reads = (size + model.read_size - 1) / model.read_size;
+        commands += reads;
+        bytes += 8 * reads + size;
+    };
+
+    if (op == FlashOp::Read) {
+        read(length);
+    } else {
+        if (op == FlashOp::Inject) {
+            address = model.inject_address;
+            length += model.inject_extra;
+        }
+        // carts that rewrite the whole chip say so with an extra of at least its size
+        const uint32_t max_length = static_cast<uint32_t>(getMaxLength());
+        if (max_length && address < max_length) {
+            length = std::min(length, max_length - address);
+        }
+
+        uint64_t erases = 0;
+        uint64_t span = 0;
+        for (uint64_t at = address; at < uint64_t(address) + length; ++erases) {
+            const FlashSector sector = getEraseSector(static_cast<uint32_t>(at));
+            span += sector.size;
+            at = uint64_t(sector.start) + sector.size;
+        }
+        const uint64_t programmed = model.rewrites_blocks ? span : length;
+        const uint64_t programs = (programmed + model.program_size - 1) / model.program_size;
+        if (model.rewrites_blocks) {
+            read(span);
+        }
+        commands += erases * model.erase_commands + programs * model.program_commands;
+        bytes += 8 * (erases * model.erase_commands + programs * model.program_commands) + programmed;
+        busy += erases * model.erase + programs * model.program;
+        if (model.blank_checks) {
+            read(span);
+        }
+        if (m_verify.mode == VerifyMode::Full) {
+            read(length);
+        }
+    }
+
+    const uint64_t modeled = commands * model.command + bytes * model.byte_ns / 1000 + busy;
+    const float speed = m_speed[static_cast<int>(op)];
+
+    m_estimate = Estimate();
+    m_estimate.op = op;
+    m_estimate.modeled = modeled;
+    m_estimate.duration = speed ? static_cast<uint64_t>(modeled * speed) : modeled;
+    m_estimate.commands = static_cast<uint32_t>(std::min<uint64_t>(commands, UINT32_MAX));
+    m_estimate.commands_before = m_counters.commands;
+    m_estimate.polls_before = m_counters.busy_polls;
+    m_estimate.timed = platform::now() != 0;
+    return m_estimate.duration;
+}
+
+uint32_t flashcart_core::Flashcart::estimatedCommandsSent() {
+    // busy polls depend on how long the flash takes, so progress is counted without them
+    return (m_counters.commands - m_estimate.commands_before) - (m_counters.busy_polls - m_estimate.polls_before);
+}
+
+uint64_t flashcart_core::Flashcart::estimateRemaining() {
+    const uint32_t sent = estimatedCommandsSent();
+    const float done = m_estimate.commands ? std::min(static_cast<float>(sent) / m_estimate.commands, 0.99f) : 0;
+    if (!m_estimate.start) {
+        return static_cast<uint64_t>(m_estimate.duration * (1 - done));
+    }
+
+    const uint64_t elapsed = platform::now() - m_estimate.start;
+    const float estimated_left = elapsed < m_estimate.duration ? m_estimate.duration - elapsed : 0;
+    // nothing sent yet, or no modeled commands to measure it against
+    if (done == 0) {
+        return static_cast<uint64_t>(estimated_left);
+    }
+
+    const float measured_left = elapsed * (1 - done) / done;
+    return static_cast<uint64_t>((1 - done) * estimated_left + done * measured_left);
+}
+
+void flashcart_core::Flashcart::finishEstimate() {
+    const uint64_t sent = estimatedCommandsSent();
+    // operations that stopped early, or ran on into ones nobody estimated, say nothing about the model
+    if (m_estimate.end > m_estimate.start && m_estimate.start && m_estimate.modeled
+            && sent >= m_estimate.commands / 2 && sent <= uint64_t(m_estimate.commands) * 2) {
+        const float measured = static_cast<float>(m_estimate.end - m_estimate.start) / m_estimate.modeled;
+        float &speed = m_speed[static_cast<int>(m_estimate.op)];
+        speed = speed ? (speed + measured) / 2 : measured;
+    }
+
+    m_estimate.timed = false;
+}
+
+void flashcart_core::Flashcart::beginProgress(const char *operation, uint32_t total) {
+    m_progress = Progress();
+    m_progress.operation = operation;
+    m_progress.operation_total = total;
+}
+
+void flashcart_core::Flashcart::showProgress(uint32_t current, uint32_t total, const char *phase) {
+    if (m_progress.muted) {
+        return;
+    }
+
+    // a different phase or total, or going backwards, is a new bar, or the next step of the operation
+    const bool new_phase = phase != m_progress.phase || total != m_progress.total || current < m_progress.current;
+    if (new_phase) {
+        if (!m_progress.operation) {
+            m_progress.start = 0;
+        } else if (m_progress.phase) {
+            m_progress.base += m_progress.total;
+        }
+        m_progress.phase = phase;
+        m_progress.total = total;
+    }
+    m_progress.current = current;
+
+    const uint32_t step_done = std::min(current, total);
+    const uint32_t bar_total = m_progress.operation ? m_progress.operation_total : total;
+    const uint32_t done = m_progress.operation ? std::min(m_progress.base + step_done, bar_total) : step_done;
+    const bool last = (done == bar_total || step_done == total) && done != m_progress.shown_done;
+    if (!new_phase && !last && done < m_progress.next) {
+        return;
+    }
+
+    const uint64_t now = platform::now();
+    if (!new_phase && !last && now && now - m_progress.shown < 50000) {
+        return;
+    }
+
+    if (!m_progress.start) {
+        m_progress.start = now;
+    }
+    m_progress.shown = now;
+    m_progress.shown_done = done;
+    m_progress.next = done + std::max<uint32_t>(bar_total / 100, 1);
+
+    const uint64_t elapsed = now - m_progress.start;
+    const ProgressEvent event = {
+        m_progress.operation ? m_progress.operation : phase, phase, done, bar_total,
+        elapsed ? static_cast<uint32_t>(std::min<uint64_t>(uint64_t(done) * 1000000 / elapsed, UINT32_MAX)) : 0
+    };
+    platform::reportProgress(event);
+}
+
+// Each traced call is a 32-byte little-endian header, followed by the command bytes, the
+// bytes sent, and the response if the driver kept it:
+//   u8 op, u8 bits (0: flagsAsIs, 1: response kept), u16 command length,
+//   u32 flags (the address for readData), u32 bytes sent, u32 response length,
+//   i32 error, u32 microseconds taken, u64 start time
+namespace {
+const size_t TRACE_HEADER_SIZE = 32;
+
+void putTrace(uint8_t *dest, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        dest[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+uint64_t getTrace(const uint8_t *src, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value |= static_cast<uint64_t>(src[i]) << (i * 8);
+    }
+    return value;
+}
+}
+
+void flashcart_core::Flashcart::recordCall(const TraceCall &call, const ncgc::Err &err, uint64_t start, uint64_t end) {
+    uint8_t header[TRACE_HEADER_SIZE];
+    header[0] = static_cast<uint8_t>(call.op);
+    header[1] = (call.flags_as_is ? BIT(0) : 0) | (call.in ? BIT(1) : 0);
+    putTrace(header + 2, call.cmd_length, 2);
+    putTrace(header + 4, call.flags, 4);
+    putTrace(header + 8, call.out_length, 4);
+    putTrace(header + 12, call.in_length, 4);
+    putTrace(header + 16, static_cast<uint32_t>(err.errNo()), 4);
+    putTrace(header + 20, end - start, 4);
+    putTrace(header + 24, start, 8);
+
+    if (!m_trace->write(header, sizeof(header))
+            || (call.cmd_length && !m_trace->write(call.cmd, call.cmd_length))
+            || (call.out_length && !m_trace->write(call.out, call.out_length))
+            || (call.in && call.in_length && !m_trace->write(call.in, call.in_length))) {
+        logMessage(LOG_ERR, "Command trace: write failed at call %u, stopping", m_trace_index);
+        m_trace = nullptr;
+    }
+    ++m_trace_index;
+}
+
+ncgc::Err flashcart_core::Flashcart::replayCall(const TraceCall &call) {
+    uint8_t header[TRACE_HEADER_SIZE];
+    uint8_t chunk[64];
+
+    // compares the next `length` bytes of the trace with `data`
+    auto matches = [this, &chunk](const void *data, size_t length) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        while (length) {
+            const size_t n = std::min(length, sizeof(chunk));
+            if (!m_trace->read(chunk, n) || std::memcmp(chunk, bytes, n)) {
+                return false;
+            }
+            bytes += n;
+            length -= n;
+        }
+        return true;
+    };
+
+    bool ok = m_trace->read(header, sizeof(header))
+        && header[0] == static_cast<uint8_t>(call.op)
+        && (header[1] & BIT(0)) == (call.flags_as_is ? BIT(0) : 0)
+        && getTrace(header + 2, 2) == call.cmd_length
+        && getTrace(header + 4, 4) == call.flags
+        && getTrace(header + 8, 4) == call.out_length
+        && getTrace(header + 12, 4) == call.in_length
+        && matches(call.cmd, call.cmd_length)
+        && matches(call.out, call.out_length);
+
+    if (ok && (header[1] & BIT(1))) {
+        // drop the response if the driver doesn't want it this time
+        for (size_t done = 0; ok && done < call.in_length; ) {
+            const size_t n = call.in ? call.in_length : std::min(call.in_length - done, sizeof(chunk));
+            ok = m_trace->read(call.in ? static_cast<uint8_t *>(call.in) : chunk, n);
+            done += n;
+        }
+    } else if (call.in) {
+        std::memset(call.in, 0, call.in_length);
+    }
+
+    ++m_trace_index;
+    if (!ok) {
+        logMessage(LOG_ERR, "Command trace: call %u doesn't match the trace", m_trace_index - 1);
+        return ncgc::Err(-1);
+    }
+    return ncgc::Err(static_cast<int32_t>(getTrace(header + 16, 4)));
+}
+
+bool flashcart_core::Flashcart::verifyFlash(uint32_t address, uint32_t length, const uint8_t *expected, uint32_t block_size, uint32_t unit) {
+    FLASH_SPAN("verify");
+    if (m_verify.mode == VerifyMode::None || !length) {
+        return true;
+    }
+
+    // one block's worth of aligned reads always fits in a block-sized buffer
+    const bool use_scratch = m_scratch_size >= block_size;
+    uint8_t *const buf = use_scratch ? m_scratch : static_cast<uint8_t *>(std::malloc(block_size));
+    if (!buf) {
+        logMessage(LOG_ERR, "verifyFlash: malloc failed");
+        return false;
+    }
+
+    // the reads are part of the write, so they don't get a progress bar of their own
+    const bool muted = m_progress.muted;
+    m_progress.muted = true;
+
+    bool result = true;
+    for (uint32_t block = PAGE_ROUND_DOWN(address, block_size); result && block < address + length; block += block_size) {
+        result = verifySpans(address, length, block, block_size, unit, [&](uint32_t span, uint32_t span_length) {
+            const uint32_t read_start = PAGE_ROUND_DOWN(span, unit);
+            const uint32_t read_end = PAGE_ROUND_UP(span + span_length, unit);
+            return readFlash(read_start, read_end - read_start, buf)
+                && !std::memcmp(buf + (span - read_start), expected + (span - address), span_length);
+        });
+
+        if (!result) {
+            logMessage(LOG_NOTICE, "Flash write verification failed at 0x%08X", block);
+        }
+    }
+
+    m_progress.muted = muted;
+    if (!use_scratch) {
+        std::free(buf);
+    }
+    return result;
+}
@@ -1,12 +1,15 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
 #include <vector>
 
 #include <ncgcpp/ntrcard.h>
 
 #include "platform.h"
+#include "span.h"
 
 using std::uint8_t;
 using std::uint16_t;
@@ -18,6 +21,145 @@ using std::uint32_t;
 
 #define BIT(n) (1 << (n))
 namespace flashcart_core {
+/// How much of a write is read back to check it.
+enum class VerifyMode {
+    Full, // Everything that was written
+    Sampled, // A few evenly spaced spots per erase block
+    Boundary, // Only the start and the end of the write
+    None
+};
+
+struct VerifyPolicy {
+    VerifyMode mode;
+    /// Spots checked per erase block in `VerifyMode::Sampled`.
+    uint32_t samples;
+    /// Read every erased block back to check it's blank, on carts that otherwise take the
+    /// chip's word for it (DSTT, DSONE, DSONEi).
+    bool blank_check;
+};
+
+/// An erase sector: `size` bytes starting at `start`.
+struct FlashSector {
+    uint32_t start;
+    uint32_t size;
+};
+
+/// Erase sectors of the given sizes in bytes, in order from address 0, for carts whose
+/// sectors aren't all the same size.
+///
+/// The last size repeats to the end of the chip, so a bottom boot block part with
+/// 16K, 8K, 8K, 32K parameter sectors and 64K main sectors is
+/// `{ 0x4000, 0x2000, 0x2000, 0x8000, 0x10000 }`.
+struct SectorLayout {
+    const uint32_t *sizes;
+    size_t count;
+
+    /// Returns the sector holding `address`.
+    FlashSector find(uint32_t address) const {
+        uint32_t start = 0;
+        for (size_t i = 0; i + 1 < count; ++i) {
+            if (address - start < sizes[i]) {
+                return { start, sizes[i] };
+            }
+            start += sizes[i];
+        }
+
+        const uint32_t last = sizes[count - 1];
+        return { start + (address - start) / last * last, last };
+    }
+};
+
+/// The `SectorLayout` of a table of sector sizes.
+template<size_t count>
+SectorLayout sectorLayout(const uint32_t (&sizes)[count]) {
+    return { sizes, count };
+}
+
+/// How often a failing erase block is written again before a write gives up.
+struct RetryPolicy {
+    /// Extra attempts per erase block; 0 fails on the first error.
+    uint32_t retries;
+    /// `ncgc::delay` before the first retry, doubled for each one after it.
+    uint32_t backoff;
+};
+
+/// Running totals of what a cart's flash operations did, to find out where the time goes.
+struct FlashCounters {
+    uint32_t commands; // Card commands and SPI transfers sent
+    uint64_t bytes_in; // Read from the card
+    uint64_t bytes_out; // Sent to the card, commands included
+    uint32_t erases;
+    uint64_t bytes_erased;
+    uint32_t erases_saved; // Erases a multi-segment write didn't do because its segments shared a block
+    uint32_t programs; // Write pages programmed; single bytes on carts that program bytes
+    uint32_t skipped_pages; // Write pages left alone because they were blank after an erase
+    uint32_t busy_polls; // Status reads while waiting for the flash
+    uint64_t bytes_requested; // Asked to be written
+    uint64_t bytes_unchanged; // Asked to be written, but already on the flash
+
+    /// Bytes erased per byte asked to be written.
+    float writeAmplification() const {
+        return bytes_requested ? static_cast<float>(bytes_erased) / bytes_requested : 0;
+    }
+};
+
+/// A flash operation, for `Flashcart::estimateDuration`.
+enum class FlashOp {
+    Read,
+    Write,
+    Inject
+};
+
+/// What a cart's flash operations cost, for `Flashcart::estimateDuration`.
+///
+/// The counts come from the driver's code. The times are rough figures for a cart in a 3DS,
+/// which the estimates correct as operations are timed during the session.
+///
+/// The defaults are a cart that programs bytes over the card bus; drivers set the fields
+/// their cart differs in.
+struct CostModel {
+    uint32_t command = 20; // Microseconds per card command or SPI transfer, besides its bytes
+    uint32_t byte_ns = 150; // Nanoseconds per byte of a command or its reply
+    uint32_t read_size = 0x200; // Bytes of flash each read command returns
+    uint32_t erase_commands = 2; // Commands each erase sends, not counting status polls
+    uint32_t erase = 500000; // Microseconds the flash is busy after each erase, status polls included
+    bool blank_checks = false; // Each erase reads its sector back to check it's blank
+    uint32_t program_size = 1; // Bytes each program writes: a page, or 1 on carts that program bytes
+    uint32_t program_commands = 2; // Commands each program sends, not counting status polls
+    uint32_t program = 20; // Microseconds the flash is busy after each program, status polls included
+    bool rewrites_blocks = true; // Writes program all of each block they erase, not just the bytes asked for
+    uint32_t inject_address = 0; // Where `injectNtrBoot` starts rewriting the flash
+    uint32_t inject_extra = 0x10000; // Bytes it rewrites besides the FIRM
+};
+
+/// Where a command trace is recorded to, or replayed from; a file, for example.
+class TraceStream {
+public:
+    virtual ~TraceStream() {}
+    virtual bool write(const void *data, size_t size) = 0;
+    virtual bool read(void *data, size_t size) = 0;
+};
+
+/// The card call a trace record is for.
+enum class TraceOp : uint8_t {
+    Command,
+    WriteCommand,
+    Spi,
+    ReadData
+};
+
+/// Answers card calls in place of the card, for a simulated cart, for example.
+///
+/// `cmd` is the 8 command bytes as they go over the bus.
+class CardBackend {
+public:
+    virtual ~CardBackend() {}
+    virtual ncgc::Err sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) = 0;
+    virtual ncgc::Err sendWriteCommand(const uint8_t *cmd, const void *buf, size_t size, uint32_t flags) = 0;
+    virtual ncgc::Err sendSpi(const uint8_t *cmd, size_t cmd_length, uint8_t *resp, size_t resp_length) = 0;
+    virtual ncgc::Err readData(uint32_t address, void *buf, size_t size) = 0;
+};
+
 class Flashcart {
 public:
     Flashcart(const char* name, const size_t max_length);
@@ -33,19 +175,323 @@ public:
     virtual bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer) = 0;
     virtual bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) = 0;
 
+    /// Like the above, but verifies the written flash according to `policy`.
+    ///
+    /// Without a policy, everything written is read back.
+    bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer, const VerifyPolicy &policy);
+    bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size, const VerifyPolicy &policy);
+
     const char *getName() { return m_name; }
     const char *getShortName() { return m_short_name; }
     virtual const char *getAuthor() { return "unknown"; }
     virtual const char *getDescription() { return ""; }
     virtual size_t getMaxLength() { return m_max_length; }
 
+    /// Size of the cart's largest erase sector.
+    virtual uint32_t getEraseSize() = 0;
+    /// The erase sector holding `address`. Carts whose sectors aren't all `getEraseSize()`
+    /// bytes override this, with a `SectorLayout` for example, and give `FlashUtil` `CartSectors`.
+    virtual FlashSector getEraseSector(uint32_t address) {
+        const uint32_t size = getEraseSize();
+        return { PAGE_ROUND_DOWN(address, size), size };
+    }
+
+    /// Number of bits in the bitmap `diff` fills for `[address, address + length)`: the
+    /// number of erase sectors the range touches.
+    uint32_t getDiffBlocks(uint32_t address, uint32_t length);
+
+    /// Compares `length` bytes of flash at `address` with `expected` without writing anything.
+    ///
+    /// Bit `n` of `dirty` (`dirty[n / 8] & BIT(n % 8)`) is set if the `n`th erase sector
+    /// the range touches differs. `dirty` must hold `getDiffBlocks(address, length)` bits.
+    /// The flash is streamed a block at a time through the scratch arena, if it has one.
+    bool diff(uint32_t address, uint32_t length, const uint8_t *expected, uint8_t *dirty);
+
+    /// Bytes of scratch space this cart needs to read and write flash without
+    /// touching the heap. 0 if it never uses a scratch arena.
+    virtual size_t getScratchSize() { return 0; }
+
+    /// Gives the cart a fixed scratch arena to use instead of the heap.
+    ///
+    /// The arena must stay valid until it is replaced or cleared with `nullptr`.
+    /// Arenas smaller than `getScratchSize()` are ignored.
+    void setScratchArena(void *arena, size_t size) {
+        m_scratch = static_cast<uint8_t *>(arena);
+        m_scratch_size = arena ? size : 0;
+    }
+
+    /// Sets how carts that write through FlashUtil retry a failing erase block.
+    /// By default nothing is retried.
+    void setRetryPolicy(const RetryPolicy &policy) { m_retry = policy; }
+
+    /// Records every card command to `trace`, or with `replay`, answers them from `trace`
+    /// instead of the card. `nullptr` stops tracing.
+    ///
+    /// Card setup done outside the command wrappers (`NTRCard::init`, key exchange) isn't
+    /// traced, so replays of carts that need it should start after `initialize()`.
+    void setTrace(TraceStream *trace, bool replay = false) {
+        m_trace = trace;
+        m_trace_replay = trace && replay;
+        m_trace_index = 0;
+    }
+
+    /// Sends every card command to `backend` instead of the card. `nullptr` goes back to the card.
+    ///
+    /// Like `setTrace`, this doesn't cover card setup done outside the command wrappers, so carts
+    /// that need it can't `initialize()` against a backend.
+    void setBackend(CardBackend *backend) { m_backend = backend; }
+
+    /// What this cart's flash operations cost. Drivers override this with their own counts;
+    /// the default is a cart that programs bytes over the card bus.
+    virtual CostModel getCostModel() { return CostModel(); }
+
+    /// Microseconds `op` should take, on `length` bytes at `address`. For `FlashOp::Inject`,
+    /// `length` is the FIRM size and `address` is ignored.
+    ///
+    /// Writes are taken to erase every block they touch, and to read and program all of it
+    /// if the cart `rewrites_blocks`. Once `platform::now()` is there, each estimated operation
+    /// is timed, and the next estimate for the same kind of operation is scaled by how far off
+    /// the earlier ones were.
+    uint64_t estimateDuration(FlashOp op, uint32_t address, uint32_t length);
+
+    /// Microseconds left in the operation `estimateDuration` was last asked about, for a
+    /// remaining-time figure; call it from `platform::reportProgress`.
+    ///
+    /// The estimate is blended with how fast the operation has gone so far, going by the
+    /// card commands sent besides status polls, and leans on the measured rate as it goes on.
+    uint64_t estimateRemaining();
+
+    const FlashCounters &getCounters() { return m_counters; }
+    void resetCounters() { m_counters = FlashCounters(); }
+
 protected:
     const char* m_name;
     const char* m_short_name;
     const size_t m_max_length;
     ncgc::NTRCard *m_card;
+    uint8_t *m_scratch;
+    size_t m_scratch_size;
+    FlashCounters m_counters;
+    VerifyPolicy m_verify;
+    RetryPolicy m_retry;
+    uint32_t m_journal;
+    TraceStream *m_trace;
+    bool m_trace_replay;
+    uint32_t m_trace_index;
+    CardBackend *m_backend;
+
+    /// The operation `estimateDuration` was last asked about.
+    struct Estimate {
+        FlashOp op;
+        uint64_t modeled; // Microseconds, from the cost model alone
+        uint64_t duration; // Microseconds, corrected by this session's timings
+        uint32_t commands; // Card commands it should send, not counting status polls
+        uint32_t commands_before; // `m_counters.commands` when it was estimated
+        uint32_t polls_before; // `m_counters.busy_polls` when it was estimated
+        bool timed; // `platform::now()` works, so its card calls are timed
+        uint64_t start; // Before its first card call
+        uint64_t end; // After its latest card call
+    };
+    Estimate m_estimate;
+    /// Measured over modeled time for each `FlashOp` so far this session; 0 before the first.
+    float m_speed[3];
+
+    /// The progress bar `showProgress` is updating.
+    struct Progress {
+        const char *operation; // Between `beginProgress` and `endProgress`, what it was started with
+        uint32_t operation_total; // And the sum of its steps' totals
+        uint32_t base; // Sum of the totals of the operation's steps before this one
+        const char *phase; // Of the latest call
+        uint32_t current; // Of the latest call
+        uint32_t total; // Of the latest call
+        uint32_t next; // Bytes done at which the next update is due
+        uint64_t start; // When the first update of the bar was shown
+        uint64_t shown; // When the latest update was shown
+        uint32_t shown_done; // What it showed
+        bool muted; // Nothing is shown while `verifyFlash` reads back a write
+    };
+    Progress m_progress;
 
     virtual bool initialize() = 0;
+
+    // Drivers talk to the card through these, so every command ends up in `m_counters`,
+    // and in the command trace if there is one, and can be answered by a backend.
+    template<typename Cmd>
+    ncgc::Err sendCommand(Cmd cmd, void *buf, size_t size, uint32_t flags, bool flagsAsIs = false) {
+        ++m_counters.commands;
+        m_counters.bytes_out += 8;
+        m_counters.bytes_in += size;
+
+        uint8_t bytes[8];
+        commandBytes(cmd, bytes);
+        return traced({ TraceOp::Command, bytes, 8, flags, flagsAsIs, nullptr, 0, buf, size }, [&]() {
+            return m_backend ? m_backend->sendCommand(bytes, buf, size, flags) : m_card->sendCommand(cmd, buf, size, flags, flagsAsIs);
+        });
+    }
+
+    ncgc::Err sendWriteCommand(uint64_t cmd, const void *buf, size_t size, uint32_t flags) {
+        ++m_counters.commands;
+        m_counters.bytes_out += 8 + size;
+
+        uint8_t bytes[8];
+        commandBytes(cmd, bytes);
+        return traced({ TraceOp::WriteCommand, bytes, 8, flags, false, buf, size, nullptr, 0 }, [&]() {
+            return m_backend ? m_backend->sendWriteCommand(bytes, buf, size, flags) : m_card->sendWriteCommand(cmd, buf, size, flags);
+        });
+    }
+
+    ncgc::Err sendSpi(const uint8_t *cmd, size_t cmd_length, uint8_t *resp, size_t resp_length) {
+        ++m_counters.commands;
+        m_counters.bytes_out += cmd_length;
+        m_counters.bytes_in += resp_length;
+
+        return traced({ TraceOp::Spi, cmd, cmd_length, 0, false, nullptr, 0, resp, resp_length }, [&]() {
+            return m_backend ? m_backend->sendSpi(cmd, cmd_length, resp, resp_length) : m_card->sendSpi(cmd, cmd_length, resp, resp_length);
+        });
+    }
+
+    ncgc::Err readData(uint32_t address, void *buf, size_t size) {
+        m_counters.commands += (size + 0x1FF) / 0x200;
+        m_counters.bytes_in += size;
+
+        return traced({ TraceOp::ReadData, nullptr, 0, address, false, nullptr, 0, buf, size }, [&]() {
+            return m_backend ? m_backend->readData(address, buf, size) : m_card->readData(address, buf, size);
+        });
+    }
+
+    void countErase(uint32_t size) {
+        ++m_counters.erases;
+        m_counters.bytes_erased += size;
+    }
+
+    /// One card call, as it goes into a command trace.
+    struct TraceCall {
+        TraceOp op;
+        const uint8_t *cmd;
+        size_t cmd_length;
+        uint32_t flags; // The address, for `TraceOp::ReadData`
+        bool flags_as_is;
+        const void *out;
+        size_t out_length;
+        void *in;
+        size_t in_length;
+    };
+
+    static void commandBytes(uint64_t cmd, uint8_t (&bytes)[8]) { std::memcpy(bytes, &cmd, 8); }
+    static void commandBytes(const uint8_t *cmd, uint8_t (&bytes)[8]) { std::memcpy(bytes, cmd, 8); }
+
+    /// Makes the card call `card_call`, unless a trace is being replayed, and records it
+    /// if one is being recorded.
+    template<typename CardCall>
+    ncgc::Err traced(const TraceCall &call, CardCall card_call) {
+        if (m_estimate.timed && !m_estimate.start) {
+            m_estimate.start = platform::now();
+        }
+
+        ncgc::Err err;
+        if (!m_trace) {
+            err = card_call();
+        } else if (m_trace_replay) {
+            err = replayCall(call);
+        } else {
+            const uint64_t start = platform::now();
+            err = card_call();
+            recordCall(call, err, start, platform::now());
+        }
+
+        if (m_estimate.timed) {
+            m_estimate.end = platform::now();
+        }
+        return err;
+    }
+
+    void recordCall(const TraceCall &call, const ncgc::Err &err, uint64_t start, uint64_t end);
+    /// Folds the timing of the last estimated operation into `m_speed`, and stops timing it.
+    void finishEstimate();
+    /// Card commands the estimated operation has sent so far, not counting status polls.
+    uint32_t estimatedCommandsSent();
+    ncgc::Err replayCall(const TraceCall &call);
+
+    /// Calls `check(address, length)` on each part of the write `[address, address + length)`
+    /// in the erase block `[block, block + block_size)` that the verification policy wants
+    /// read back, and stops at the first one that returns false.
+    ///
+    /// `unit` is the smallest read the cart can do; sampled spots run to the end of the
+    /// `unit`-aligned read they fall in. `block_size` and `unit` must be powers of two.
+    template<typename Check>
+    bool verifySpans(uint32_t address, uint32_t length, uint32_t block, uint32_t block_size, uint32_t unit, Check check) {
+        const uint32_t start = std::max(address, block);
+        const uint32_t end = std::min(address + length, block + block_size);
+        if (start >= end) {
+            return true;
+        }
+
+        switch (m_verify.mode) {
+            case VerifyMode::Full:
+                return check(start, end - start);
+            case VerifyMode::Sampled: {
+                const uint32_t stride = std::max((end - start) / std::max<uint32_t>(m_verify.samples, 1), unit);
+                for (uint32_t spot = start; spot < end; spot += stride) {
+                    const uint32_t spot_end = std::min<uint32_t>(PAGE_ROUND_DOWN(spot, unit) + unit, end);
+                    if (!check(spot, spot_end - spot)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            case VerifyMode::Boundary: {
+                uint32_t tail = PAGE_ROUND_DOWN(end - 1, unit);
+                if (start == address) {
+                    const uint32_t head_end = std::min<uint32_t>(PAGE_ROUND_DOWN(start, unit) + unit, end);
+                    if (!check(start, head_end - start)) {
+                        return false;
+                    }
+                    tail = std::max(tail, head_end);
+                }
+                return end != address + length || tail >= end || check(tail, end - tail);
+            }
+            case VerifyMode::None:
+                break;
+        }
+
+        return true;
+    }
+
+    /// Folds `size` bytes of `data` into `hash` (FNV-1a), to build the id a write's journal is kept under.
+    static uint32_t journalHash(const void *data, size_t size, uint32_t hash = 2166136261u);
+
+    /// Starts journaling the write `id` over `[address, end)`, and returns where to resume it:
+    /// `address`, unless an interrupted attempt at the same write got further.
+    uint32_t beginJournal(uint32_t id, uint32_t address, uint32_t end);
+    /// Like the above, for writing `length` bytes of `buffer` at `address`.
+    uint32_t beginJournal(uint32_t address, uint32_t length, const uint8_t *buffer) {
+        const uint32_t id = journalHash(&length, sizeof(length), journalHash(&address, sizeof(address)));
+        return beginJournal(journalHash(buffer, length, id), address, address + length);
+    }
+    /// Starts journaling the inject `id`, which reads `[address, address + length)` into `buffer`,
+    /// changes it and writes it back from `resume`. `buffer` gets the flash as it was before the
+    /// first attempt at the inject: the copy that attempt kept, or else what's there now, which
+    /// is kept in case this one is interrupted too.
+    bool beginInjectJournal(uint32_t id, uint32_t address, uint32_t length, uint8_t *buffer, uint32_t &resume);
+    /// Records that everything before `address` in the current write is written and verified.
+    void updateJournal(uint32_t address) { platform::saveJournal(m_journal, address); }
+    /// Drops the current write's journal once it has finished.
+    void endJournal() { platform::clearJournal(m_journal); }
+
+    /// Drivers report progress through this rather than `platform::showProgress`, as often as
+    /// they like. It passes on an update about every percent, and no more often than every
+    /// 50ms once `platform::now()` is there, plus the first and last of each phase.
+    void showProgress(uint32_t current, uint32_t total, const char *phase);
+    /// Shows the steps until `endProgress` as one bar, `operation`. Each run of `showProgress`
+    /// calls with the same phase and total is a step, and `total` is the sum of their totals.
+    void beginProgress(const char *operation, uint32_t total);
+    void endProgress() { m_progress.operation = nullptr; }
+
+    /// Reads back a write through `readFlash` and checks it according to the verification policy.
+    ///
+    /// For carts that don't verify through FlashUtil. `block_size` is the cart's erase block size,
+    /// and `unit` the smallest read `readFlash` can do.
+    bool verifyFlash(uint32_t address, uint32_t length, const uint8_t *expected, uint32_t block_size, uint32_t unit);
 };
 
 extern std::vector<Flashcart*> *flashcart_list;
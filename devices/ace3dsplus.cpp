@@ -4,15 +4,13 @@
 
 #include "../device.h"
 #include "../flash_util.h"
+#include "../kernels.h"
 
 namespace flashcart_core {
-using platform::logMessage;
-using platform::showProgress;
-
 class Ace3DSPlus : Flashcart {
     /// Gets the cart version (in the high halfword) and status (in the low byte).
     bool cmdVersionStatus(uint32_t *resp) {
-        ncgc::Err r = m_card->sendCommand(0xB0, resp, 4, 0x180000);
+        ncgc::Err r = sendCommand(0xB0, resp, 4, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdVersionStatus failed: %d", r.errNo());
             return false;
@@ -22,7 +20,7 @@ class Ace3DSPlus : Flashcart {
 
     /// Sets some SD-related register on the card (?)
     bool cmdSdRegister(uint8_t param) {
-        ncgc::Err r = m_card->sendCommand(0xC2ull | (((uint64_t) param) << 32), NULL, 0, 0x180000);
+        ncgc::Err r = sendCommand(0xC2ull | (((uint64_t) param) << 32), NULL, 0, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdSdRegister failed: %d", r.errNo());
             return false;
@@ -44,7 +42,7 @@ class Ace3DSPlus : Flashcart {
         cmd.u8[6] = z;
         cmd.u8[7] = 0;
 
-        ncgc::Err r = m_card->sendCommand(cmd.u64, nullptr, 0, 0x180000);
+        ncgc::Err r = sendCommand(cmd.u64, nullptr, 0, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdSdRaw failed: %d", r.errNo());
             return false;
@@ -94,7 +92,7 @@ class Ace3DSPlus : Flashcart {
         ncgc::Err r;
         uint32_t resp = 1;
         do {
-            if ((r = m_card->sendCommand(0xB9, &resp, 4, 0x180000))) {
+            if ((r = sendCommand(0xB9, &resp, 4, 0x180000))) {
                 logMessage(LOG_ERR, "Ace3DSPlus: cmdSdReadSector failed: %d", r.errNo());
                 return false;
             }
@@ -107,7 +105,7 @@ class Ace3DSPlus : Flashcart {
     ///
     /// We don't care about the result.
     bool cmdReadSdBufferPlain(void *resp = nullptr) {
-        ncgc::Err r = m_card->sendCommand(0xBA, resp, 0x200, 0x180000);
+        ncgc::Err r = sendCommand(0xBA, resp, 0x200, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdReadSdBufferPlain failed: %d", r.errNo());
             return false;
@@ -120,7 +118,7 @@ class Ace3DSPlus : Flashcart {
     ///
     /// We don't care about the result.
     bool cmdReadSdBufferCrypted() {
-        ncgc::Err r = m_card->sendCommand(0xBF, nullptr, 0x200, 0x180000);
+        ncgc::Err r = sendCommand(0xBF, nullptr, 0x200, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdReadSdBufferCrypted failed: %d", r.errNo());
             return false;
@@ -131,48 +129,15 @@ class Ace3DSPlus : Flashcart {
     bool cmdEnableFlash() {
         uint32_t bufu32[0x200/4];
         uint8_t *buf = reinterpret_cast<uint8_t *>(bufu32);
-        ncgc::Err r = m_card->sendCommand(0xC6, buf, 0x200, 0x180000);
+        ncgc::Err r = sendCommand(0xC6, buf, 0x200, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdEnableFlash 0xC6 failed: %d", r.errNo());
             return false;
         }
 
-        /*
-            result = 0;
-            v3 = v1 + 512;
-            do {
-                v4 = *v1++ & 1;
-                result = 2 * result | v4;
-            } while ( v1 != v3 );
-        */
-        // they loop over the whole 512 bytes but..
-        // an int's only 32 bits????????
-        // TODO verify this
-        uint32_t weird_sum = 0;
-        for (int i = 0; i < 32; ++i) {
-            if (buf[i + (0x200 - 32)] & 1) {
-                weird_sum |= (1 << (31 - i));
-            }
-        }
+        kernels::ace3dsplusEnableFlash(bufu32);
 
-        for (int i = 0; i < 0x200/4; ++i) {
-            if (i & 1) {
-                bufu32[i] <<= 1;
-            } else {
-                bufu32[i] >>= 1;
-            }
-        }
-
-        for (int i = 0; i < 0x200; ++i) {
-            uint32_t sum_lsl1 = weird_sum << 1;
-            if ((sum_lsl1 ^ weird_sum) & 0x8000) {
-                sum_lsl1 |= 1;
-            }
-            buf[i] = (sum_lsl1 & 0x8000) ? (buf[i] | 1) : (buf[i] & ~1);
-            weird_sum = sum_lsl1;
-        }
-
-        if((r = m_card->sendWriteCommand(0xC3FF3CA5AA555AC7, buf, 0x200, 0))) {
+        if((r = sendWriteCommand(0xC3FF3CA5AA555AC7, buf, 0x200, 0))) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdEnableFlash 0xC7 failed: %d", r.errNo());
             return false;
         }
@@ -182,7 +147,7 @@ class Ace3DSPlus : Flashcart {
 
     bool spiRdid(uint32_t *rdid) {
         static const uint8_t cmd[] = { 0x9F };
-        ncgc::Err r = m_card->sendSpi(cmd, 1, reinterpret_cast<uint8_t *>(rdid), 3);
+        ncgc::Err r = sendSpi(cmd, 1, reinterpret_cast<uint8_t *>(rdid), 3);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: spiRdid failed: %d", r.errNo());
             return false;
@@ -198,7 +163,7 @@ class Ace3DSPlus : Flashcart {
         cmd[2] = (address & 0xFF00) >> 8;
         cmd[3] = address & 0xFF;
 
-        ncgc::Err r = m_card->sendSpi(cmd, 4, reinterpret_cast<uint8_t *>(buf), size);
+        ncgc::Err r = sendSpi(cmd, 4, reinterpret_cast<uint8_t *>(buf), size);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: spiRead failed: %d", r.errNo());
             return false;
@@ -208,7 +173,7 @@ class Ace3DSPlus : Flashcart {
 
     bool spiWriteEnable() {
         static const uint8_t cmd[] = { 0x6 };
-        ncgc::Err r = m_card->sendSpi(cmd, 1, nullptr, 0);
+        ncgc::Err r = sendSpi(cmd, 1, nullptr, 0);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: spiWriteEnable failed: %d", r.errNo());
             return false;
@@ -217,14 +182,16 @@ class Ace3DSPlus : Flashcart {
     }
 
     bool spiWaitWrite() {
+        FLASH_SPAN("busy-wait");
         static const uint8_t rdsr[] = { 0x5 };
         uint8_t sr = 1;
         do {
-            ncgc::Err r = m_card->sendSpi(rdsr, 1, &sr, 1);
+            ncgc::Err r = sendSpi(rdsr, 1, &sr, 1);
             if (r) {
                 logMessage(LOG_ERR, "Ace3DSPlus: spiWaitWrite failed: %d", r.errNo());
                 return false;
             }
+            ++m_counters.busy_polls;
         } while (sr & 1);
 
         return true;
@@ -236,7 +203,7 @@ class Ace3DSPlus : Flashcart {
         cmd[2] = (address & 0xFF00) >> 8;
         cmd[3] = address & 0xFF;
 
-        ncgc::Err r = m_card->sendSpi(cmd, 4, nullptr, 0);
+        ncgc::Err r = sendSpi(cmd, 4, nullptr, 0);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: spiSectorErase failed: %d", r.errNo());
             return false;
@@ -253,7 +220,7 @@ class Ace3DSPlus : Flashcart {
         cmd[3] = address & 0xFF;
         std::memcpy(cmd + 4, src, 256);
 
-        ncgc::Err r = m_card->sendSpi(cmd, sizeof(cmd), nullptr, 0);
+        ncgc::Err r = sendSpi(cmd, sizeof(cmd), nullptr, 0);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: spiPageProgram failed: %d", r.errNo());
             return false;
@@ -275,6 +242,7 @@ class Ace3DSPlus : Flashcart {
     }
 
     bool tryBlowfishKey(BlowfishKey key) {
+        FLASH_SPAN("secure init");
         ncgc::Err err = m_card->init();
         if (err && !err.unsupported()) {
             logMessage(LOG_ERR, "Ace3DSPlus: tryBlowfishKey: ntrcard init failed");
@@ -304,6 +272,7 @@ class Ace3DSPlus : Flashcart {
     }
 
     bool cartSdInit() {
+        FLASH_SPAN("SD init");
         uint8_t buf[0x200];
         if (!cmdSdRegister(0)
             || !cmdSd(0, 0, 4, buf)) {
@@ -381,12 +350,13 @@ class Ace3DSPlus : Flashcart {
 
     void aapReadData(uint32_t addr) {
         ncgc::Err err;
-        if ((err = m_card->readData(addr, nullptr, 0x200))) {
+        if ((err = readData(addr, nullptr, 0x200))) {
             logMessage(LOG_INFO, "Ace3DSPlus: readData failed: %d", err.errNo());
         }
     }
 
     bool passAntiAntiPiracy() {
+        FLASH_SPAN("AAP");
         // Deep Labyrinth flash
         aapReadData(0x10FE00);
         aapReadData(0x167400);
@@ -420,14 +390,18 @@ class Ace3DSPlus : Flashcart {
         // last ditch attempt (sweep the first 2M and see if it works)
         // (this works for the Deep Labyrinth flash)
         ncgc::Err err;
-        if ((err = m_card->readData(0x8000, nullptr, 0x200000 - 0x8000))
-            || (err = m_card->readData(0x8000, nullptr, 0x200000 - 0x8000))) {
+        if ((err = readData(0x8000, nullptr, 0x200000 - 0x8000))
+            || (err = readData(0x8000, nullptr, 0x200000 - 0x8000))) {
             logMessage(LOG_INFO, "Ace3DSPlus: readData failed: %d", err.errNo());
         }
         return tryPollVersion();
     }
 
     using Util = FlashUtil<Ace3DSPlus, 0, &Ace3DSPlus::spiRead, 12, &Ace3DSPlus::flashUtilErase, 8, &Ace3DSPlus::flashUtilPageProgram>;
+    friend Util;
+
+    // the flash injectNtrBoot rewrites at 0: the config map, the blowfish key and the version info
+    static constexpr uint32_t configSize = 0x9100;
 
 public:
     Ace3DSPlus() : Flashcart("Ace3DS+", "Ace3DSPlus", 0x200000) { }
@@ -519,6 +493,28 @@ public:
 
     void shutdown() {}
 
+    // FlashUtil's buffers, then injectNtrBoot's config page
+    size_t getScratchSize() {
+        return Util::scratchSize + configSize;
+    }
+
+    uint32_t getEraseSize() {
+        return Util::eraseSize;
+    }
+
+    CostModel getCostModel() {
+        // every SPI transfer is a card command; erase and program are WREN, then the command.
+        // injectNtrBoot writes the config at 0 and the FIRM at 0xAE00
+        CostModel model;
+        model.byte_ns = 1000;
+        model.read_size = 0x1000;
+        model.erase = 50000;
+        model.program_size = 0x100;
+        model.program = 700;
+        model.inject_extra = 0xAE00;
+        return model;
+    }
+
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer) {
         return Util::read(this, address, length, buffer, true);
     }
@@ -533,27 +529,23 @@ public:
             return false;
         }
 
-        void *configPage = std::calloc(0x9100, 1);
+        const bool use_scratch = m_scratch_size >= getScratchSize();
+        void *configPage = use_scratch ? m_scratch + Util::scratchSize : std::malloc(configSize);
         if (!configPage) {
             logMessage(LOG_ERR, "malloc failed");
             return false;
         }
+        std::memset(configPage, 0, configSize);
 
-        // map = struct.unpack("<8192H", flash[0:0x4000]) # python
-        // 0x4000:0x8000 is the map for pre-"anti-anti-piracy" (AAP)
-        // nor_address(rom_address) = (map[rom_address >> 12] << 12) + (rom_address & 0xFFF)
         uint16_t *configMap = static_cast<uint16_t *>(configPage);
-        for (int i = 0; i < 8; ++i) {
-            configMap[i] = 0xA;
-        }
-        for (int i = 0; i < (0x4000/2) - 8; ++i) {
-            configMap[i+8] = 0xB+i;
-        }
-        std::memcpy(configMap + 0x2000, configMap, 0x2000*2);
+        kernels::ace3dsplusConfigMap(configMap);
 
         // grab the flash version info/hw rev/fw rev stuff off the flash
         if (!spiRead(0x9050, 0xB0, static_cast<uint8_t *>(configPage) + 0x9050)) {
             logMessage(LOG_ERR, "Flash read failed");
+            if (!use_scratch) {
+                std::free(configPage);
+            }
             return false;
         }
 
@@ -581,9 +573,14 @@ public:
             std::memcpy(configBfKey + 0x1000 + (0x11 - i)*4, blowfish_key + i*4, 4);
         }
 
-        bool result = Util::write(this, 0, 0x9100, configPage, true, "Writing configuration")
-            && Util::write(this, 0xAE00, firm_size, firm, true, "Writing FIRM");
-        std::free(configPage);
+        FlashSegment segments[] = {
+            { 0, configSize, configPage },
+            { 0xAE00, firm_size, firm }
+        };
+        bool result = Util::writeMany(this, segments, 2, true, "Writing ntrboot");
+        if (!use_scratch) {
+            std::free(configPage);
+        }
         return result;
     }
 };
@@ -2,11 +2,9 @@
 
 #include <stdlib.h>
 #include <cstring>
+#include <algorithm>
 
 namespace flashcart_core {
-using platform::logMessage;
-using platform::showProgress;
-
 class AK2i : Flashcart {
 protected:
     static const uint8_t ak2i_cmdWaitFlashBusy[8];
@@ -33,7 +31,8 @@ protected:
             // I've been trying to get down to the bottom of this delay for a while
             // hopefully soon it will no longer be needed.
             // ioDelay( 16 * 10 );
-            m_card->sendCommand(ak2i_cmdWaitFlashBusy, &state, 4, 4);
+            sendCommand(ak2i_cmdWaitFlashBusy, &state, 4, 4);
+            ++m_counters.busy_polls;
             logMessage(LOG_DEBUG, "AK2i: waitFlashBusy = 0x%08x", state);
         } while ((state & 1) != 0);
     }
@@ -47,11 +46,20 @@ protected:
         cmdbuf[3] = (address >>  8) & 0xFF;
         cmdbuf[4] = (address >>  0) & 0xFF;
 
-        m_card->sendCommand(cmdbuf, outbuf, 0x200, 2);
+        sendCommand(cmdbuf, outbuf, 0x200, 2);
         // a2ki_wait_flash_busy();
     }
 
+    void a2ki_unlock() {
+        sendCommand(ak2i_cmdUnlockFlash, nullptr, 0, 0);
+        sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
+
+        if (m_ak2i_hwrevision == 0x81818181) sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
+        sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
+    }
+
     void a2ki_erase(uint32_t address) {
+        FLASH_SPAN("erase");
         uint8_t cmdbuf[8] = {0};
 
         logMessage(LOG_DEBUG, "AK2i: erase(0x%08x)", address);
@@ -69,7 +77,8 @@ protected:
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        m_card->sendCommand(cmdbuf, nullptr, 0, (m_ak2i_hwrevision == 0x81818181) ? 20 : 0 );
+        sendCommand(cmdbuf, nullptr, 0, (m_ak2i_hwrevision == 0x81818181) ? 20 : 0 );
+        countErase(page_size);
         a2ki_wait_flash_busy();
     }
 
@@ -92,16 +101,58 @@ protected:
         cmdbuf[3] = (address >>  0) & 0xFF;
         cmdbuf[4] = value;
 
-        m_card->sendCommand(cmdbuf, nullptr, 0, 20);
+        sendCommand(cmdbuf, nullptr, 0, 20);
+        ++m_counters.programs;
         a2ki_wait_flash_busy();
     }
 
+    // writes `length` bytes of `buffer` at `address`, starting from `resume` in the current journal
+    bool writePages(uint32_t address, uint32_t length, const uint8_t *buffer, uint32_t resume)
+    {
+        m_counters.bytes_requested += length;
+
+        // verify each page as it's written, so the journal only holds finished pages
+        for (uint32_t addr=resume - address; addr < length; addr+=page_size)
+        {
+            // readFlash locks the flash again, so unlock it for every page
+            a2ki_unlock();
+            a2ki_erase(address + addr);
+
+            const uint32_t page_length = std::min<uint32_t>(page_size, length - addr);
+            {
+                FLASH_SPAN("program");
+                for (uint32_t i=0; i < page_length; i++) {
+                    a2ki_writebyte(address + addr + i, buffer[addr + i]);
+                    showProgress(addr+i+1,length, "Writing");
+                }
+            }
+
+            if (!verifyFlash(address + addr, page_length, buffer + addr, page_size, 0x200))
+                return false;
+            updateJournal(address + addr + page_length);
+        }
+
+        endJournal();
+        return true;
+    }
+
 public:
     AK2i() : Flashcart("Acekard 2i", "ak2i", 0x200000) { }
 
     const char *getAuthor() { return "Kitlith + Normmatt"; }
     const char *getDescription() { return "Works with the following carts:\n * Acekard 2i HW-44\n * Acekard 2i HW-81\n * R4i Ultra (r4ultra.com)"; }
 
+    uint32_t getEraseSize() { return page_size; }
+    // unlock, then erase; bytes are programmed one command each
+    CostModel getCostModel() {
+        CostModel model;
+        model.erase_commands = 5;
+        model.program_commands = 1;
+        model.inject_address = 0x80000;
+        model.inject_extra = 0x9E00;
+        return model;
+    }
+
     size_t getMaxLength()
     {
         if (m_ak2i_hwrevision == 0x44444444) return 0x200000;
@@ -112,22 +163,22 @@ public:
     bool initialize()
     {
         logMessage(LOG_INFO, "AK2i: Init");
-        m_card->sendCommand(ak2i_cmdGetHWRevision, &m_ak2i_hwrevision, 4, 0);
+        sendCommand(ak2i_cmdGetHWRevision, &m_ak2i_hwrevision, 4, 0);
         logMessage(LOG_NOTICE, "AK2i: HW Revision = %08x", m_ak2i_hwrevision);
 
         if (m_ak2i_hwrevision == 0x44444444)
         {
-            m_card->sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
-            m_card->sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 0);
-            m_card->sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
+            sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
+            sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 0);
+            sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
         }
         else if (m_ak2i_hwrevision == 0x81818181)
         {
-            m_card->sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
-            m_card->sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 0);
-            m_card->sendCommand(ak2i_cmdUnlockFlash, nullptr, 0, 0);
-            m_card->sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
-            m_card->sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
+            sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
+            sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 0);
+            sendCommand(ak2i_cmdUnlockFlash, nullptr, 0, 0);
+            sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
+            sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
         } else {
             return false;
         }
@@ -138,18 +189,18 @@ public:
     void shutdown()
     {
         logMessage(LOG_INFO, "AK2i: Shutdown");
-        m_card->sendCommand(ak2i_cmdLockFlash, nullptr, 0, 0);
-        m_card->sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
-        m_card->sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 4);
+        sendCommand(ak2i_cmdLockFlash, nullptr, 0, 0);
+        sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
+        sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 4);
     }
 
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer)
     {
         logMessage(LOG_INFO, "AK2i: readFlash(addr=0x%08x, size=0x%x)", address, length);
-        m_card->sendCommand(ak2i_cmdLockFlash, nullptr, 0, 0);
+        sendCommand(ak2i_cmdLockFlash, nullptr, 0, 0);
 
-        if (m_ak2i_hwrevision == 0x81818181) m_card->sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
-        m_card->sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
+        if (m_ak2i_hwrevision == 0x81818181) sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
+        sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
 
         for (uint32_t curpos=0; curpos < length; curpos+=0x200) {
             a2ki_read(buffer + curpos, address + curpos);
@@ -162,23 +213,7 @@ public:
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer)
     {
         logMessage(LOG_INFO, "AK2i: writeFlash(addr=0x%08x, size=0x%x)", address, length);
-        m_card->sendCommand(ak2i_cmdUnlockFlash, nullptr, 0, 0);
-        m_card->sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
-
-        if (m_ak2i_hwrevision == 0x81818181) m_card->sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
-        m_card->sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
-
-        for (uint32_t addr=0; addr < length; addr+=page_size)
-        {
-            a2ki_erase(address + addr);
-
-            for (uint32_t i=0; i < page_size; i++) {
-                a2ki_writebyte(address + addr + i, buffer[addr + i]);
-                showProgress(addr+i+1,length, "Writing");
-            }
-        }
-
-        return true;
+        return writePages(address, length, buffer, beginJournal(address, length, buffer));
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size)
@@ -194,19 +229,34 @@ public:
         uint32_t buf_size = PAGE_ROUND_UP(firm_offset + firm_size, page_size);
         uint8_t *buf = (uint8_t *)calloc(buf_size, sizeof(uint8_t));
 
+        // the journal is kept under what's injected, as the flash read back changes once the inject starts
+        const uint32_t offsets[] = { blowfish_adr, firm_offset, chipid_offset };
+        uint32_t id = journalHash(offsets, sizeof(offsets));
+        id = journalHash(blowfish_key, 0x1048, id);
+        id = journalHash(&firm_size, sizeof(firm_size), id);
+        id = journalHash(firm, firm_size, id);
+
         logMessage(LOG_INFO, "AK2i: Injecting Ntrboot");
-        readFlash(blowfish_adr, buf_size, buf); // Read in data that shouldn't be changed
+        beginProgress("Injecting ntrboot", 2 * buf_size);
+        uint32_t resume;
+        // Read in data that shouldn't be changed
+        if (!beginInjectJournal(id, blowfish_adr, buf_size, buf, resume)) {
+            endProgress();
+            free(buf);
+            return false;
+        }
         memcpy(buf, blowfish_key, 0x1048);
         memcpy(buf + firm_offset, firm, firm_size);
 
         uint8_t chipid_and_length[8] = {0x00, 0x00, 0x0F, 0xC2, 0x00, 0xB4, 0x17, 0x00};
         memcpy(buf + chipid_offset, chipid_and_length, 8);
 
-        writeFlash(blowfish_adr, buf_size, buf);
+        bool result = writePages(blowfish_adr, buf_size, buf, resume);
+        endProgress();
 
         free(buf);
 
-        return true;
+        return result;
     }
 };
 
@@ -26,14 +26,12 @@ Known flashchips that are "unsupported":
 */
 
 #include "../device.h"
+#include "../nor_chip.h"
 
 #include <stdlib.h>
 #include <cstring>
 
 namespace flashcart_core {
-using platform::logMessage;
-using platform::showProgress;
-
 const uint16_t supported_flashchips[] = {
     0xD7BF
 };
@@ -64,7 +62,7 @@ private:
 
         uint32_t ret;
 
-        m_card->sendCommand(cmd, (uint8_t*)&ret, 4, 0xa7180000);
+        sendCommand(cmd, (uint8_t*)&ret, 4, 0xa7180000);
         return ret;
     }
 
@@ -78,6 +76,9 @@ private:
         }
     }
 
+    using Chip = NorChip<DSONE, &DSONE::DSONE_flash_command, &DSONE::DSONE_reset>;
+    friend Chip;
+
     uint32_t get_flashchip_id()
     {
         uint32_t flashchip;
@@ -136,9 +137,10 @@ private:
         return false;
     }
 
-    void Erase_Block(uint32_t offset, uint32_t length)
+    bool Erase_Block(uint32_t offset, uint32_t length)
     {
         logMessage(LOG_DEBUG, "DSONE: erase_block(0x%08x)", offset);
+        countErase(length);
         if (m_cmd_type == DSONE_CMD_TYPE_1) {
             DSONE_flash_command(0x87, 0x5555, 0xAA);
             DSONE_flash_command(0x87, 0x2AAA, 0x55);
@@ -146,7 +148,11 @@ private:
             DSONE_flash_command(0x87, 0x5555, 0xAA);
             DSONE_flash_command(0x87, 0x2AAA, 0x55);
 
-            DSONE_flash_command(0x87, offset, 0x30);
+            // the SST39VF040 erases a 64K block (0x50) as fast as a 4K sector (0x30)
+            DSONE_flash_command(0x87, offset, length == 0x10000 ? 0x50 : 0x30);
+
+            if (!Chip::waitErase(this, offset))
+                return false;
         } else if (m_cmd_type == DSONE_CMD_TYPE_2) {
 			/*
             DSONE_flash_command(0x87, 0x00,   0x50); // Clear Status Register
@@ -161,15 +167,23 @@ private:
 			*/
         }
 
-        uint32_t end_offset = offset + length;
+        if (!m_verify.blank_check)
+            return true;
+
+        FLASH_SPAN("blank check");
+        const uint32_t end_offset = offset + length;
         for (; offset < end_offset; offset += 4)
         {
-            // TODO: Timeout if something goes wrong.
-            while (DSONE_flash_command(0, offset, 0) != 0xFFFFFFFF);
+            if (DSONE_flash_command(0, offset, 0) != 0xFFFFFFFF) {
+                logMessage(LOG_ERR, "DSONE: erase_block: 0x%08x isn't blank", offset);
+                return false;
+            }
         }
+        return true;
     }
 
-    void Erase_Chip(uint32_t offset) {
+    bool Erase_Chip(uint32_t offset) {
+        FLASH_SPAN("erase");
         std::vector<uint32_t> erase_blocks;
         logMessage(LOG_INFO, "DSONE: Erasing Flash");
 
@@ -182,7 +196,11 @@ private:
 			*/
 
             default:
-                erase_blocks = std::vector<uint32_t>(0x10, 0x1000);
+                // one block erase, if the 64K is a block of its own
+                if (m_cmd_type == DSONE_CMD_TYPE_1 && !(offset & 0xFFFF))
+                    erase_blocks = {0x10000};
+                else
+                    erase_blocks = std::vector<uint32_t>(0x10, 0x1000);
                 break;
         }
 
@@ -195,15 +213,20 @@ private:
         uint32_t erase_addr = offset;
         for (auto const& block_sz: erase_blocks) {
             showProgress(erase_addr, erase_endaddr, "Erasing Blocks");
-            Erase_Block(erase_addr, block_sz);
+            if (!Erase_Block(erase_addr, block_sz))
+                return false;
             erase_addr += block_sz;
         }
+        showProgress(erase_endaddr, erase_endaddr, "Erasing Blocks");
+
+        return true;
     }
 
     // pretty messy function, but gets the job done
     void Program_Byte(uint32_t offset, uint8_t data)
     {
         logMessage(LOG_DEBUG, "DSONE: program_byte(0x%08x) = 0x%02x", offset, data);
+        ++m_counters.programs;
         if (m_cmd_type == DSONE_CMD_TYPE_2) {
 			/*
             DSONE_flash_command(0x87, 0x00,   0x50); // Clear Status Register
@@ -223,7 +246,8 @@ private:
             DSONE_flash_command(0x87, offset, data);
 
             // TODO: Timeout if something goes wrong.
-            while ((uint8_t)DSONE_flash_command(0, offset, 0) != data);
+            while ((uint8_t)DSONE_flash_command(0, offset, 0) != data)
+                ++m_counters.busy_polls;
         }
     }
 
@@ -232,6 +256,22 @@ public:
 
     const char *getAuthor() { return "multi-vitamin"; }
     const char *getDescription() { return "Only works with DSONE SDHC (SST39VF040) for now."; }
+    // writeFlash erases the 64K from its address in one go, even where it falls back to 4K sectors
+    uint32_t getEraseSize() { return 0x10000; }
+    // each 64K block erase is 6 commands and a status read, and the block is read back a word at a time
+    // if it's blank checked; a byte program is 4 commands and a read back. injectNtrBoot rewrites
+    // the whole chip
+    CostModel getCostModel() {
+        CostModel model;
+        model.read_size = 4;
+        model.erase_commands = 7;
+        model.blank_checks = m_verify.blank_check;
+        model.erase = 25000;
+        model.program_commands = 5;
+        model.rewrites_blocks = false;
+        model.inject_extra = static_cast<uint32_t>(m_max_length);
+        return model;
+    }
 
     bool initialize()
     {
@@ -287,16 +327,21 @@ public:
     {
         // really fucking temporary, writeFlash can only do full length writes
         // todo: read and erase properly
-        Erase_Chip(address);
+        if (!Erase_Chip(address))
+            return false;
         logMessage(LOG_INFO, "DSONE: writeFlash(addr=0x%08x, size=0x%x)", address, length);
+        m_counters.bytes_requested += length;
 
-        for(uint32_t i = 0; i < length; i++)
         {
-            showProgress(i+1, length, "Writing");
-            Program_Byte(address++, buffer[i]);
+            FLASH_SPAN("program");
+            for(uint32_t i = 0; i < length; i++)
+            {
+                showProgress(i+1, length, "Writing");
+                Program_Byte(address + i, buffer[i]);
+            }
         }
 
-        return true;
+        return verifyFlash(address, length, buffer, getEraseSize(), 4);
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) {
@@ -311,15 +356,19 @@ public:
         }
 
         uint8_t* buffer = (uint8_t*)malloc(m_max_length);
+        // the chip is read, its first 64K erased, and it's all written back
+        beginProgress("Injecting ntrboot", 2 * m_max_length + 0x10000);
         readFlash(0, m_max_length, buffer);
 
         memcpy(buffer + 0x1000, blowfish_key, 0x48);
         memcpy(buffer + 0x2000, blowfish_key + 0x48, 0x1000);
         memcpy(buffer + 0x7E00, firm, firm_size);
 
-        writeFlash(0, m_max_length, buffer);
+        bool result = writeFlash(0, m_max_length, buffer);
+        endProgress();
+        free(buffer);
 
-        return true;
+        return result;
     }
 };
 
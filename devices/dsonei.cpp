@@ -26,14 +26,12 @@ Known flashchips that are "unsupported":
 */
 
 #include "../device.h"
+#include "../nor_chip.h"
 
 #include <stdlib.h>
 #include <cstring>
 
 namespace flashcart_core {
-using platform::logMessage;
-using platform::showProgress;
-
 /*
 const uint16_t supported_flashchips[] = {
     0xD7BF
@@ -52,6 +50,9 @@ private:
         DSONEi_CMD_TYPE_2
     } m_cmd_type;
 
+    bool m_bypass_supported; // the chip takes unlock bypass programs, as far as we know
+    bool m_unlock_bypass; // the chip is in unlock bypass mode
+
     uint32_t DSONEi_flash_command(uint8_t data0, uint32_t data1, uint16_t data2)
     {
         uint8_t cmd[8];
@@ -66,7 +67,7 @@ private:
 
         uint32_t ret;
 
-        m_card->sendCommand(cmd, (uint8_t*)&ret, 4, 0xa7180000);
+        sendCommand(cmd, (uint8_t*)&ret, 4, 0xa7180000);
         return ret;
     }
 
@@ -80,6 +81,9 @@ private:
         }
     }
 
+    using Chip = NorChip<DSONEi, &DSONEi::DSONEi_flash_command, &DSONEi::DSONEi_reset>;
+    friend Chip;
+
     uint32_t get_flashchip_id()
     {
         uint32_t flashchip;
@@ -140,9 +144,10 @@ private:
         return true;
     }
 
-    void Erase_Block(uint32_t offset, uint32_t length)
+    bool Erase_Block(uint32_t offset, uint32_t length)
     {
         logMessage(LOG_DEBUG, "DSONEi: erase_block(0x%08x)", offset);
+        countErase(length);
         if (m_cmd_type == DSONEi_CMD_TYPE_1) {
             DSONEi_flash_command(0x87, 0x5555, 0xAA);
             DSONEi_flash_command(0x87, 0x2AAA, 0x55);
@@ -151,6 +156,9 @@ private:
             DSONEi_flash_command(0x87, 0x2AAA, 0x55);
 
             DSONEi_flash_command(0x87, offset, 0x30);
+
+            if (!Chip::waitErase(this, offset))
+                return false;
         } else if (m_cmd_type == DSONEi_CMD_TYPE_2) {
 			/*
             DSONEi_flash_command(0x87, 0x00,   0x50); // Clear Status Register
@@ -165,15 +173,23 @@ private:
 			*/
         }
 
-        uint32_t end_offset = offset + length;
+        if (!m_verify.blank_check)
+            return true;
+
+        FLASH_SPAN("blank check");
+        const uint32_t end_offset = offset + length;
         for (; offset < end_offset; offset += 4)
         {
-            // TODO: Timeout if something goes wrong.
-            while (DSONEi_flash_command(0, offset, 0) != 0xFFFFFFFF);
+            if (DSONEi_flash_command(0, offset, 0) != 0xFFFFFFFF) {
+                logMessage(LOG_ERR, "DSONEi: erase_block: 0x%08x isn't blank", offset);
+                return false;
+            }
         }
+        return true;
     }
 
-    void Erase_Chip(uint32_t offset) {
+    bool Erase_Chip(uint32_t offset) {
+        FLASH_SPAN("erase");
         std::vector<uint32_t> erase_blocks;
         logMessage(LOG_INFO, "DSONEi: Erasing Flash");
 
@@ -199,15 +215,24 @@ private:
         uint32_t erase_addr = offset;
         for (auto const& block_sz: erase_blocks) {
             showProgress(erase_addr, erase_endaddr, "Erasing Blocks");
-            Erase_Block(erase_addr, block_sz);
+            if (!Erase_Block(erase_addr, block_sz))
+                return false;
             erase_addr += block_sz;
         }
+        showProgress(erase_endaddr, erase_endaddr, "Erasing Blocks");
+
+        return true;
     }
 
     // pretty messy function, but gets the job done
     void Program_Byte(uint32_t offset, uint8_t data)
     {
         logMessage(LOG_DEBUG, "DSONEi: program_byte(0x%08x) = 0x%02x", offset, data);
+        ++m_counters.programs;
+        // chips that turn out not to take unlock bypass programs are programmed the long way below
+        if (m_unlock_bypass && Chip::programByte(this, offset, data))
+            return;
+
         if (m_cmd_type == DSONEi_CMD_TYPE_2) {
 			/*
             DSONEi_flash_command(0x87, 0x00,   0x50); // Clear Status Register
@@ -227,15 +252,31 @@ private:
             DSONEi_flash_command(0x87, offset, data);
 
             // TODO: Timeout if something goes wrong.
-            while ((uint8_t)DSONEi_flash_command(0, offset, 0) != data);
+            while ((uint8_t)DSONEi_flash_command(0, offset, 0) != data)
+                ++m_counters.busy_polls;
         }
     }
 
 public:
-    DSONEi() : Flashcart("DSONEi", 0x400000) { }
+    DSONEi() : Flashcart("DSONEi", 0x400000), m_bypass_supported(false), m_unlock_bypass(false) { }
 
     const char *getAuthor() { return "multi-vitamin"; }
     const char *getDescription() { return "Experimental DSONEi support."; }
+    uint32_t getEraseSize() { return 0x10000; }
+    // each block erase is 6 commands and a status read, and the block is read back a word at a time
+    // if it's blank checked; a byte program is 4 commands and a read back, or 2 in unlock bypass
+    // mode. injectNtrBoot rewrites the whole chip
+    CostModel getCostModel() {
+        CostModel model;
+        model.read_size = 4;
+        model.erase_commands = 7;
+        model.blank_checks = m_verify.blank_check;
+        model.erase = 700000;
+        model.program_commands = m_bypass_supported ? 3 : 5;
+        model.rewrites_blocks = false;
+        model.inject_extra = static_cast<uint32_t>(m_max_length);
+        return model;
+    }
 
     bool initialize()
     {
@@ -255,6 +296,8 @@ public:
                 m_cmd_type = DSONEi_CMD_TYPE_1;
                 break;
         }
+        m_bypass_supported = Chip::supportsUnlockBypass(m_flashchip) && m_cmd_type == DSONEi_CMD_TYPE_1;
+        m_unlock_bypass = false;
 
         return true;
     }
@@ -291,16 +334,23 @@ public:
     {
         // really fucking temporary, writeFlash can only do full length writes
         // todo: read and erase properly
-        Erase_Chip(address);
+        if (!Erase_Chip(address))
+            return false;
         logMessage(LOG_INFO, "DSONEi: writeFlash(addr=0x%08x, size=0x%x)", address, length);
+        m_counters.bytes_requested += length;
 
-        for(uint32_t i = 0; i < length; i++)
         {
-            showProgress(i+1, length, "Writing");
-            Program_Byte(address++, buffer[i]);
+            FLASH_SPAN("program");
+            Chip::enterUnlockBypass(this);
+            for(uint32_t i = 0; i < length; i++)
+            {
+                showProgress(i+1, length, "Writing");
+                Program_Byte(address + i, buffer[i]);
+            }
+            Chip::exitUnlockBypass(this);
         }
 
-        return true;
+        return verifyFlash(address, length, buffer, getEraseSize(), 4);
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) {
@@ -315,15 +365,19 @@ public:
         }
 
         uint8_t* buffer = (uint8_t*)malloc(m_max_length);
+        // the chip is read, its first 64K erased, and it's all written back
+        beginProgress("Injecting ntrboot", 2 * m_max_length + 0x10000);
         readFlash(0, m_max_length, buffer);
 
         memcpy(buffer + 0x1000, blowfish_key, 0x48);
         memcpy(buffer + 0x2000, blowfish_key + 0x48, 0x1000);
         memcpy(buffer + 0x7E00, firm, firm_size);
 
-        writeFlash(0, m_max_length, buffer);
+        bool result = writeFlash(0, m_max_length, buffer);
+        endProgress();
+        free(buffer);
 
-        return true;
+        return result;
     }
 };
 
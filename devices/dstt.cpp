@@ -93,14 +93,10 @@ Known flashchips that are "unsupported":
 */
 
 #include "../device.h"
-
-#include <stdlib.h>
-#include <cstring>
+#include "../flash_util.h"
+#include "../nor_chip.h"
 
 namespace flashcart_core {
-using platform::logMessage;
-using platform::showProgress;
-
 const uint16_t supported_flashchips[] = {
     0x041F, 0x051F, 0x1A37, 0x3437, 0x49C2, 0x5BC2, 0x80BF, 0x9020, 0x9120, 0x9B37,
     0xA01F, 0xA31F, 0xA7C2, 0xA8C2, 0xBA01, 0xBA04, 0xBA1C, 0xBA4A, 0xBAC2, 0xB537,
@@ -111,6 +107,17 @@ const uint16_t supported_flashchips[] = {
     0x9689, 0x9789
 };
 
+// The flashchips' erase sectors, from address 0. This driver only writes the first 64K, but the
+// boot block parts go on in 64K sectors after it.
+constexpr uint32_t sectors_64k[] = {0x10000};
+constexpr uint32_t sectors_16k_8k_8k_32k[] = {0x4000, 0x2000, 0x2000, 0x8000, 0x10000};
+constexpr uint32_t sectors_2k[] = {0x800};
+constexpr uint32_t sectors_32k_8k_8k_16k[] = {0x8000, 0x2000, 0x2000, 0x4000, 0x10000};
+constexpr uint32_t sectors_4k_32k[] = {0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x8000, 0x10000};
+constexpr uint32_t sectors_32k_4k[] = {0x8000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x10000};
+constexpr uint32_t sectors_16k[] = {0x4000};
+constexpr uint32_t sectors_8k_4k_4k_16k_32k[] = {0x2000, 0x1000, 0x1000, 0x4000, 0x8000, 0x10000};
+
 // Header: TOP TF/SD DSTTDS
 // Device ID: 0xFC2
 // Sector Size: 0x2000
@@ -123,6 +130,14 @@ private:
         DSTT_CMD_TYPE_2
     } m_cmd_type;
 
+    bool m_bypass_supported; // the chip takes unlock bypass programs, as far as we know
+    bool m_unlock_bypass; // the chip is in unlock bypass mode
+    bool m_programming; // the chip has been programmed since it was last put back in read array mode
+    bool m_batch_erase; // sector erases can be queued in one erase cycle, as far as we know
+    uint32_t m_erasing[0x10000 / 0x800]; // sectors in the erase cycle flash_erase started, if any
+    size_t m_erasing_count;
+    SectorLayout m_sectors;
+
     uint32_t dstt_flash_command(uint8_t data0, uint32_t data1, uint16_t data2)
     {
         uint8_t cmd[8];
@@ -137,7 +152,7 @@ private:
 
         uint32_t ret;
 
-        m_card->sendCommand(cmd, (uint8_t*)&ret, 4, 0xa7180000);
+        sendCommand(cmd, (uint8_t*)&ret, 4, 0xa7180000);
         return ret;
     }
 
@@ -151,6 +166,9 @@ private:
         }
     }
 
+    using Chip = NorChip<DSTT, &DSTT::dstt_flash_command, &DSTT::dstt_reset>;
+    friend Chip;
+
     uint32_t get_flashchip_id()
     {
         uint32_t flashchip;
@@ -206,7 +224,8 @@ private:
         return false;
     }
 
-    void Erase_Block(uint32_t offset, uint32_t length)
+
+    bool Erase_Block(uint32_t offset, uint32_t length)
     {
         logMessage(LOG_DEBUG, "DSTT: erase_block(0x%08x)", offset);
         if (m_cmd_type == DSTT_CMD_TYPE_1) {
@@ -217,30 +236,51 @@ private:
             dstt_flash_command(0x87, 0x2AAA, 0x55);
 
             dstt_flash_command(0x87, offset, 0x30);
+
+            if (!Chip::waitErase(this, offset))
+                return false;
         } else if (m_cmd_type == DSTT_CMD_TYPE_2) {
             dstt_flash_command(0x87, 0x00,   0x50); // Clear Status Register
             dstt_flash_command(0x87, offset, 0x20); // Erase Setup
             dstt_flash_command(0x87, offset, 0xD0); // Erase Confirm
 
-            // TODO: Timeout if something goes wrong.
-            while (!(dstt_flash_command(0, offset & 0xFFFFFFFC, 0) & 0x80));
+            FLASH_SPAN("busy-wait");
+            uint32_t status;
+            for (uint32_t polls = 0; !((status = dstt_flash_command(0, offset & 0xFFFFFFFC, 0)) & 0x80); ++polls) {
+                if (polls == Chip::eraseTimeout) {
+                    logMessage(LOG_ERR, "DSTT: erase_block(0x%08x) timed out", offset);
+                    dstt_reset();
+                    return false;
+                }
+                ++m_counters.busy_polls;
+            }
 
             dstt_flash_command(0x87, 0x00, 0x50); // Clear Status Register
             dstt_flash_command(0x87, 0x00, 0xFF); // Reset
+            if (status & 0x20) {
+                logMessage(LOG_ERR, "DSTT: erase_block(0x%08x) failed, status 0x%02x", offset, (uint8_t)status);
+                return false;
+            }
         }
 
-        uint32_t end_offset = offset + length;
+        return !m_verify.blank_check || blank_check(offset, length);
+    }
+
+    bool blank_check(uint32_t offset, uint32_t length)
+    {
+        FLASH_SPAN("blank check");
+        const uint32_t end_offset = offset + length;
         for (; offset < end_offset; offset += 4)
         {
-            // TODO: Timeout if something goes wrong.
-            while (dstt_flash_command(0, offset, 0) != 0xFFFFFFFF);
+            if (dstt_flash_command(0, offset, 0) != 0xFFFFFFFF) {
+                logMessage(LOG_ERR, "DSTT: erase: 0x%08x isn't blank", offset);
+                return false;
+            }
         }
+        return true;
     }
 
-    void Erase_Chip() {
-        std::vector<uint32_t> erase_blocks;
-        logMessage(LOG_INFO, "DSTT: Erasing Flash");
-
+    SectorLayout get_sectors() {
         switch(m_flashchip)
         {
             case 0x041F:
@@ -248,18 +288,15 @@ private:
             case 0xA01F:
             case 0xA31F:
             case 0xB91C:
-                erase_blocks = {0x10000};
-                break;
+                return sectorLayout(sectors_64k);
 
             case 0x051F:
-                erase_blocks = {0x4000, 0x2000, 0x2000, 0x8000};
-                break;
+                return sectorLayout(sectors_16k_8k_8k_32k);
 
             case 0x80BF:
             case 0xC11F:
             case 0xC31F:
-                erase_blocks = std::vector<uint32_t>(0x20, 0x800);
-                break;
+                return sectorLayout(sectors_2k);
 
             case 0x1A37:
             case 0x3437:
@@ -267,8 +304,7 @@ private:
             case 0xC298:
             case 0xC420:
             case 0xC4C2:
-                erase_blocks = {0x8000, 0x2000, 0x2000, 0x4000};
-                break;
+                return sectorLayout(sectors_32k_8k_8k_16k);
 
             case 0x49B0:
             case 0x912C:
@@ -278,20 +314,15 @@ private:
             case 0x9389:
             case 0x9589:
             case 0x9789:
-                erase_blocks = std::vector<uint32_t>(9, 0x1000);
-                erase_blocks[8] = 0x8000;
-                break;
+                return sectorLayout(sectors_4k_32k);
 
             case 0x9289:
             case 0x9489:
             case 0x9689:
-                erase_blocks = std::vector<uint32_t>(9, 0x1000);
-                erase_blocks[0] = 0x8000;
-                break;
+                return sectorLayout(sectors_32k_4k);
 			
 			case 0xED01:
-				erase_blocks = std::vector<uint32_t>(4, 0x4000);
-				break;
+				return sectorLayout(sectors_16k);
 
             case 0x49C2:
             case 0x5BC2:
@@ -308,21 +339,7 @@ private:
             case 0xEE20:
             case 0xEF20:
             default:
-                erase_blocks = {0x2000, 0x1000, 0x1000, 0x4000, 0x8000};
-                break;
-        }
-
-        // calculate the max so we can show progress
-        uint32_t erase_endaddr = 0;
-        for (auto const& block_sz: erase_blocks) {
-            erase_endaddr += block_sz;
-        }
-
-        uint32_t erase_addr = 0;
-        for (auto const& block_sz: erase_blocks) {
-            showProgress(erase_addr, erase_endaddr, "Erasing Blocks");
-            Erase_Block(erase_addr, block_sz);
-            erase_addr += block_sz;
+                return sectorLayout(sectors_8k_4k_4k_16k_32k);
         }
     }
 
@@ -336,10 +353,14 @@ private:
             dstt_flash_command(0x87, offset, data);
 
             // TODO: Timeout if something goes wrong.
-            while (!(dstt_flash_command(0, offset & 0xFFFFFFFC, 0) & 0x80));
+            while (!(dstt_flash_command(0, offset & 0xFFFFFFFC, 0) & 0x80))
+                ++m_counters.busy_polls;
 
             dstt_flash_command(0x87, 0x00, 0x50); // Clear Status Register
             //dstt_flash_command(0x87, offset, 0xFF); // Reset (offset not required)
+        } else if (m_unlock_bypass) {
+            if (!Chip::programByte(this, offset, data))
+                Program_Byte(offset, data);
         } else if (m_cmd_type == DSTT_CMD_TYPE_1) {
             dstt_flash_command(0x87, 0x5555, 0xAA);
             dstt_flash_command(0x87, 0x2AAA, 0x55);
@@ -347,15 +368,125 @@ private:
             dstt_flash_command(0x87, offset, data);
 
             // TODO: Timeout if something goes wrong.
-            while ((uint8_t)dstt_flash_command(0, offset, 0) != data);
+            while ((uint8_t)dstt_flash_command(0, offset, 0) != data)
+                ++m_counters.busy_polls;
+        }
+    }
+
+    // Puts the chip back in read array mode after programming: out of unlock bypass mode on
+    // AMD-style chips, and out of the status register on Intel-style ones.
+    void end_programming() {
+        if (!m_programming)
+            return;
+
+        Chip::exitUnlockBypass(this);
+        dstt_reset();
+        m_programming = false;
+    }
+
+    // Waits for the erase cycle flash_erase started, and blank checks its sectors. DQ3 goes high once
+    // the window for more addresses closes and the erase starts; FlashUtil calls this right after the
+    // last address, so if it's high already, one of them came too late, and the chip may have ignored
+    // any of them but the first.
+    bool end_erase() {
+        const size_t count = m_erasing_count;
+        if (!count)
+            return true;
+
+        m_erasing_count = 0;
+        const bool queued = count == 1 || !(dstt_flash_command(0, m_erasing[0], 0) & 0x08);
+        if (!Chip::waitErase(this, m_erasing[0]))
+            return false;
+
+        if (!queued) {
+            logMessage(LOG_WARN, "DSTT: Sector erases can't be queued fast enough, erasing one at a time");
+            m_batch_erase = false;
+            for (size_t i = 1; i < count; ++i)
+                if (!Erase_Block(m_erasing[i], m_sectors.find(m_erasing[i]).size))
+                    return false;
+            return !m_verify.blank_check || blank_check(m_erasing[0], m_sectors.find(m_erasing[0]).size);
+        }
+
+        if (m_verify.blank_check)
+            for (size_t i = 0; i < count; ++i)
+                if (!blank_check(m_erasing[i], m_sectors.find(m_erasing[i]).size))
+                    return false;
+        return true;
+    }
+
+    // FlashUtil's read, erase and program; programs stay in unlock bypass mode until the next
+    // read or erase.
+    bool flash_read(uint32_t address, uint32_t size, void *dest) {
+        end_programming();
+        const uint32_t data = dstt_flash_command(0, address, 0);
+        uint8_t *const buffer = static_cast<uint8_t *>(dest);
+        buffer[0] = (uint8_t)((data >> 0) & 0xFF);
+        buffer[1] = (uint8_t)((data >> 8) & 0xFF);
+        buffer[2] = (uint8_t)((data >> 16) & 0xFF);
+        buffer[3] = (uint8_t)((data >> 24) & 0xFF);
+        return true;
+    }
+
+    // AMD-style chips take the addresses of more sectors while an erase waits out its 50us window,
+    // so the erases FlashUtil sends back to back go into one erase cycle, which end_erase waits for.
+    bool flash_erase(uint32_t address) {
+        end_programming();
+        if (m_cmd_type != DSTT_CMD_TYPE_1 || !m_batch_erase)
+            return Erase_Block(address, m_sectors.find(address).size);
+
+        logMessage(LOG_DEBUG, "DSTT: erase_block(0x%08x)", address);
+        if (m_erasing_count == sizeof(m_erasing) / sizeof(m_erasing[0]) && !end_erase())
+            return false;
+        if (!m_erasing_count) {
+            dstt_flash_command(0x87, 0x5555, 0xAA);
+            dstt_flash_command(0x87, 0x2AAA, 0x55);
+            dstt_flash_command(0x87, 0x5555, 0x80);
+            dstt_flash_command(0x87, 0x5555, 0xAA);
+            dstt_flash_command(0x87, 0x2AAA, 0x55);
         }
+        dstt_flash_command(0x87, address, 0x30);
+        m_erasing[m_erasing_count++] = address;
+        return true;
     }
 
+    bool flash_program(uint32_t address, const void *src) {
+        Chip::enterUnlockBypass(this);
+        m_programming = true;
+        Program_Byte(address, *static_cast<const uint8_t *>(src));
+        return true;
+    }
+
+    // every chip's sectors are whole 2K pieces, from the SST parts' 2K up to 64K
+    using Sectors = CartSectors<0x10000, 0x800>;
+    static_assert(Sectors::fits(sectors_64k) && Sectors::fits(sectors_16k_8k_8k_32k) && Sectors::fits(sectors_2k)
+        && Sectors::fits(sectors_32k_8k_8k_16k) && Sectors::fits(sectors_4k_32k) && Sectors::fits(sectors_32k_4k)
+        && Sectors::fits(sectors_16k) && Sectors::fits(sectors_8k_4k_4k_16k_32k), "DSTT sectors must fit FlashUtil's erase page");
+    using Util = FlashUtil<DSTT, 2, &DSTT::flash_read, 16, &DSTT::flash_erase, 0, &DSTT::flash_program, Sectors,
+        &DSTT::end_erase>;
+    friend Util;
+
 public:
-    DSTT() : Flashcart("DSTT", 0x10000) { }
+    DSTT() : Flashcart("DSTT", 0x10000), m_bypass_supported(false), m_unlock_bypass(false), m_programming(false),
+        m_batch_erase(false), m_erasing_count(0), m_sectors(sectorLayout(sectors_64k)) { }
 
     const char *getAuthor() { return "handsomematt"; }
     const char *getDescription() { return "This will run on the official DSTT as well as a\nlot of clones.\n\nCheck the README.md for further details."; }
+    uint32_t getEraseSize() { return Util::eraseSize; }
+    FlashSector getEraseSector(uint32_t address) { return m_sectors.find(address); }
+    size_t getScratchSize() { return Util::scratchSize; }
+    // each sector erase is 6 commands and a status read, and the sector is read back a word at a time
+    // if it's blank checked; a byte program is 4 commands and a read back, or 2 in unlock bypass mode.
+    // injectNtrBoot writes the key at 0x1000 and 0x2000, and the FIRM at 0x7E00
+    CostModel getCostModel() {
+        CostModel model;
+        model.read_size = 4;
+        model.erase_commands = 7;
+        model.erase = 700000;
+        model.blank_checks = m_verify.blank_check;
+        model.program_commands = m_bypass_supported ? 3 : 5;
+        model.inject_extra = 0x7E00;
+        return model;
+    }
 
     bool initialize()
     {
@@ -386,6 +517,14 @@ public:
                 m_cmd_type = DSTT_CMD_TYPE_1;
                 break;
         }
+        m_bypass_supported = Chip::supportsUnlockBypass(m_flashchip) && m_cmd_type == DSTT_CMD_TYPE_1;
+        m_unlock_bypass = false;
+        m_programming = false;
+        m_batch_erase = m_cmd_type == DSTT_CMD_TYPE_1;
+        m_erasing_count = 0;
+        m_sectors = get_sectors();
+        // the reset after the ID read went out before the command set was known
+        dstt_reset();
 
         return true;
     }
@@ -396,47 +535,19 @@ public:
 
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer) {
         logMessage(LOG_INFO, "DSTT: readFlash(addr=0x%08x, size=0x%x)", address, length);
+        end_programming();
         dstt_reset();
-
-        uint32_t i = 0;
-        uint32_t end_address = address + length;
-
-        while (address < end_address)
-        {
-            uint32_t data = dstt_flash_command(0, address, 0);
-            showProgress(address+1, end_address, "Reading");
-
-            buffer[i++] = (uint8_t)((data >> 0) & 0xFF);
-            buffer[i++] = (uint8_t)((data >> 8) & 0xFF);
-            buffer[i++] = (uint8_t)((data >> 16) & 0xFF);
-            buffer[i++] = (uint8_t)((data >> 24) & 0xFF);
-
-            address += 4;
-        }
-
-        return true;
+        return Util::read(this, address, length, buffer, true);
     }
 
-    // todo: we're just assuming this is block (0x2000) aligned
-    bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer)
-    {
-        // really fucking temporary, writeFlash can only do full length writes
-        // todo: read and erase properly
-        Erase_Chip();
+    bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer) {
         logMessage(LOG_INFO, "DSTT: writeFlash(addr=0x%08x, size=0x%x)", address, length);
-
-        for(uint32_t i = 0; i < length; i++)
-        {
-            showProgress(i+1, length, "Writing");
-            Program_Byte(address++, buffer[i]);
-        }
-
-        return true;
+        const bool result = Util::write(this, address, length, buffer, true);
+        end_programming();
+        return result;
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) {
-        // todo: we just read and write the entire flash chip because we don't align blocks
-        // properly, when writeFlash works, don't use memcpy
         logMessage(LOG_INFO, "DSTT: Injecting Ntrboot");
 
         // don't bother installing if we can't fit
@@ -445,16 +556,14 @@ public:
             return false; // todo: return error code
         }
 
-        uint8_t* buffer = (uint8_t*)malloc(m_max_length);
-        readFlash(0, m_max_length, buffer);
-
-        memcpy(buffer + 0x1000, blowfish_key, 0x48);
-        memcpy(buffer + 0x2000, blowfish_key + 0x48, 0x1000);
-        memcpy(buffer + 0x7E00, firm, firm_size);
-
-        writeFlash(0, m_max_length, buffer);
-
-        return true;
+        FlashSegment segments[] = {
+            { 0x1000, 0x48, blowfish_key }, // blowfish P array
+            { 0x2000, 0x1000, blowfish_key + 0x48 }, // blowfish S boxes
+            { 0x7E00, firm_size, firm } // FIRM
+        };
+        const bool result = Util::writeMany(this, segments, 3, true, "Writing ntrboot");
+        end_programming();
+        return result;
     }
 };
 
@@ -4,8 +4,6 @@
 
 namespace flashcart_core {
 using ntrcard::sendCommand;
-using platform::logMessage;
-using platform::showProgress;
 
 class Example : Flashcart {
     public:
@@ -30,6 +28,19 @@ class Example : Flashcart {
 
         void shutdown() { }
 
+        // largest erase block of the flash chip
+        uint32_t getEraseSize() { return 0x10000; }
+
+        // what read, erase and program cost on this cart, for progress estimates;
+        // set the CostModel fields your cart differs from the defaults in
+        CostModel getCostModel() {
+            CostModel model;
+            model.erase_commands = 1; // commands each erase sends
+            model.program_commands = 1; // and each byte program
+            model.rewrites_blocks = false; // writes only program the bytes they're given
+            return model;
+        }
+
         bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer) { return true; }
         bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer) { return true; }
         bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) { return true; }
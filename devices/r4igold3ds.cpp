@@ -1,4 +1,5 @@
 #include "../device.h"
+#include "../kernels.h"
 
 #include <cstring>
 #include <algorithm>
@@ -6,9 +7,6 @@
 #define BIT(n) (1 << (n))
 
 namespace flashcart_core {
-using platform::logMessage;
-using platform::showProgress;
-
 struct r4i_flash_setting {
     uint32_t blowfish_chunk_adr;
     uint32_t blowfish_offset;
@@ -21,29 +19,6 @@ struct r4i_flash_setting {
 
 class R4i_Gold_3DS : Flashcart {
 private:
-    uint8_t encrypt(uint8_t dec, uint32_t offset)
-    {
-        uint8_t enc = 0;
-        switch (m_r4i_type) {
-            case 1: //rev9-D
-            case 3: //rev6-7 maybe 8
-                if (dec & BIT(0)) enc |= BIT(4);
-                if (dec & BIT(1)) enc |= BIT(3);
-                if (dec & BIT(2)) enc |= BIT(7);
-                if (dec & BIT(3)) enc |= BIT(6);
-                if (dec & BIT(4)) enc |= BIT(1);
-                if (dec & BIT(5)) enc |= BIT(0);
-                if (dec & BIT(6)) enc |= BIT(2);
-                if (dec & BIT(7)) enc |= BIT(5);
-                return enc;
-            case 2: //rev4-5
-                enc = (offset % 256) + 9;
-                return enc ^ dec;
-        }
-        // FIXME throw error
-        return enc;
-    }
-
     static uint8_t decrypt(uint8_t enc)
     {
          uint8_t dec = 0;
@@ -60,8 +35,7 @@ private:
 
     void encrypt_memcpy(uint8_t *dst, uint8_t *src, uint32_t length)
     {
-        for(int i = 0; i < (int)length; ++i)
-            dst[i] = encrypt(src[i], i);
+        kernels::r4iGoldEncrypt(dst, src, length, m_r4i_type);
     }
 
     void r4i_read(uint8_t *outbuf, uint32_t address) {
@@ -72,12 +46,13 @@ private:
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        m_card->sendCommand(cmdbuf, outbuf, 0x200, 32);
+        sendCommand(cmdbuf, outbuf, 0x200, 32);
         r4i_wait_flash_busy();
     }
 
     void r4i_erase(uint32_t address)
     {
+        FLASH_SPAN("erase");
         uint32_t status;
         uint8_t cmdbuf[8];
         logMessage(LOG_DEBUG, "R4iGold: erase(0x%08x)", address);
@@ -86,7 +61,8 @@ private:
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        m_card->sendCommand(cmdbuf, &status, 4, 32);
+        sendCommand(cmdbuf, &status, 4, 32);
+        countErase(0x10000);
         r4i_wait_flash_busy();
     }
 
@@ -101,28 +77,61 @@ private:
         cmdbuf[3] = (address >>  0) & 0xFF;
         cmdbuf[4] = value;
 
-        m_card->sendCommand(cmdbuf, &status, 4, 32);
+        sendCommand(cmdbuf, &status, 4, 32);
+        ++m_counters.programs;
         r4i_wait_flash_busy();
     }
 
     void r4i_wait_flash_busy() {
         uint32_t state;
         do {
-            m_card->sendCommand(cmdWaitFlashBusy, &state, 4, 32);
+            sendCommand(cmdWaitFlashBusy, &state, 4, 32);
+            ++m_counters.busy_polls;
             logMessage(LOG_DEBUG, "R4iGold: waitFlashBusy = 0x%08x", state);
         } while ((state & 1) != 0);
     }
 
-    void injectFlash(uint32_t chunk_addr, uint32_t chunk_length, uint32_t offset, uint8_t *src, uint32_t src_length, bool encrypt) {
+    // writes `length` bytes of `buffer` at `address`, starting from `resume` in the current journal
+    bool writeBlocks(uint32_t address, uint32_t length, const uint8_t *buffer, uint32_t resume)
+    {
+        m_counters.bytes_requested += length;
+        // one block at a time, so the journal only holds finished blocks
+        for (uint32_t addr=resume - address; addr < length; addr+=0x10000) {
+            r4i_erase(address + addr);
+
+            const uint32_t block_length = std::min<uint32_t>(0x10000, length - addr);
+            {
+                FLASH_SPAN("program");
+                for (uint32_t i=addr; i < addr + block_length; i++) {
+                    r4i_writebyte(address + i, buffer[i]);
+                    showProgress(i+1,length, "Writing");
+                }
+            }
+
+            if (!verifyFlash(address + addr, block_length, buffer + addr, 0x10000, 0x200))
+                return false;
+            updateJournal(address + addr + block_length);
+        }
+
+        endJournal();
+        return true;
+    }
+
+    // `id` is the inject's, from what it injects; the chunk's flash as read back changes once it starts
+    bool injectFlash(uint32_t id, uint32_t chunk_addr, uint32_t chunk_length, uint32_t offset, uint8_t *src, uint32_t src_length, bool encrypt) {
         uint8_t *chunk = (uint8_t *)malloc(chunk_length);
-        readFlash(chunk_addr, chunk_length, chunk);
-        if (encrypt) {
-            encrypt_memcpy(chunk + offset, src, src_length);
-        } else {
-            memcpy(chunk + offset, src, src_length);
+        uint32_t resume;
+        bool result = beginInjectJournal(journalHash(&offset, sizeof(offset), id), chunk_addr, chunk_length, chunk, resume);
+        if (result) {
+            if (encrypt) {
+                encrypt_memcpy(chunk + offset, src, src_length);
+            } else {
+                memcpy(chunk + offset, src, src_length);
+            }
+            result = writeBlocks(chunk_addr, chunk_length, chunk, resume);
         }
-        writeFlash(chunk_addr, chunk_length, chunk);
         free(chunk);
+        return result;
     }
 
 protected:
@@ -161,13 +170,25 @@ public:
         return 0x0;
     }
 
+    uint32_t getEraseSize() { return 0x10000; }
+    // injectNtrBoot rewrites two 64K chunks with the key and FIRM header, then the FIRM at 0x80000
+    CostModel getCostModel() {
+        CostModel model;
+        model.erase_commands = 1;
+        model.program_commands = 1;
+        model.rewrites_blocks = false;
+        model.inject_address = 0x80000;
+        model.inject_extra = 0x20000;
+        return model;
+    }
+
     bool initialize()
     {
         logMessage(LOG_INFO, "R4iGold: Init");
         uint32_t hw_revision;
         uint32_t hw_type;
-        m_card->sendCommand(cmdGetHWRevision, (uint8_t*)&hw_revision, 4, 0);
-        m_card->sendCommand(cmdCardType, (uint8_t*)&hw_type, 4, 0);
+        sendCommand(cmdGetHWRevision, (uint8_t*)&hw_revision, 4, 0);
+        sendCommand(cmdCardType, (uint8_t*)&hw_type, 4, 0);
         logMessage(LOG_NOTICE, "R4iGold: HW Revision = %08x", hw_revision);
         logMessage(LOG_NOTICE, "R4iGold: HW Type = %08x", hw_type);
 
@@ -220,15 +241,7 @@ public:
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer)
     {
         logMessage(LOG_INFO, "R4iGold: writeFlash(addr=0x%08x, size=0x%x)", address, length);
-        for (uint32_t addr=0; addr < length; addr+=0x10000)
-            r4i_erase(address + addr);
-
-        for (uint32_t i=0; i < length; i++) {
-            r4i_writebyte(address + i, buffer[i]);
-            showProgress(i+1,length, "Writing");
-        }
-
-        return true;
+        return writeBlocks(address, length, buffer, beginJournal(address, length, buffer));
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size)
@@ -247,12 +260,19 @@ public:
         }
 
         logMessage(LOG_INFO, "R4iGold: Injecting ntrboot");
-        injectFlash(set->blowfish_chunk_adr, 0x10000, set->blowfish_offset, blowfish_key, 0x1048, set->encrypt_header);
-        injectFlash(set->firm_hdr_chunk_adr, 0x10000, set->firm_hdr_offset, firm, 0x200, set->encrypt_header);
-
         uint32_t buf_size = PAGE_ROUND_UP(firm_size - 0x200 + set->firm_offset, 0x10000);
-        injectFlash(set->firm_chunk_adr, buf_size, set->firm_offset, firm + 0x200, firm_size, true);
-        return true;
+        // the cart type picks the offsets and the scrambling
+        uint32_t id = journalHash(&m_r4i_type, sizeof(m_r4i_type));
+        id = journalHash(blowfish_key, 0x1048, id);
+        id = journalHash(&firm_size, sizeof(firm_size), id);
+        id = journalHash(firm, firm_size, id);
+        // each chunk is read, then written
+        beginProgress("Injecting ntrboot", 2 * (0x10000 + 0x10000 + buf_size));
+        bool result = injectFlash(id, set->blowfish_chunk_adr, 0x10000, set->blowfish_offset, blowfish_key, 0x1048, set->encrypt_header)
+            && injectFlash(id, set->firm_hdr_chunk_adr, 0x10000, set->firm_hdr_offset, firm, 0x200, set->encrypt_header)
+            && injectFlash(id, set->firm_chunk_adr, buf_size, set->firm_offset, firm + 0x200, firm_size - 0x200, true);
+        endProgress();
+        return result;
     }
 };
 
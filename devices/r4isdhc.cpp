@@ -6,9 +6,6 @@
 #include "../flash_util.h"
 
 namespace flashcart_core {
-using platform::logMessage;
-using platform::showProgress;
-
 namespace {
 union CmdBuf4 {
         uint32_t u32;
@@ -37,7 +34,7 @@ static_assert(norRaw(0x34, 0x56, 0x12) == 0x56341299, "norRaw result is wrong");
 class R4iSDHC : Flashcart {
     uint32_t norRead(const uint32_t address) {
         CmdBuf4 buf;
-        m_card->sendCommand(norCmd(2, 5, 0x3B, address), buf.u8, 4, 0x180000);
+        sendCommand(norCmd(2, 5, 0x3B, address), buf.u8, 4, 0x180000);
         logMessage(LOG_DEBUG, "R4ISDHC: NOR read at %X returned %X", address, buf.u32);
         return buf.u32;
     }
@@ -50,13 +47,14 @@ class R4iSDHC : Flashcart {
     }
 
     void norWriteEnable() {
-        m_card->sendCommand(norCmd(0, 1, 6, 0), nullptr, 4, 0x180000);
+        sendCommand(norCmd(0, 1, 6, 0), nullptr, 4, 0x180000);
         ncgc::delay(0x60000);
     }
 
     bool norErase4k(const uint32_t address) {
         norWriteEnable();
-        m_card->sendCommand(norCmd(0, 4, 0x20, address), nullptr, 4, 0x180000);
+        sendCommand(norCmd(0, 4, 0x20, address), nullptr, 4, 0x180000);
+        FLASH_SPAN("busy-wait");
         ncgc::delay(41000000);
 
         // now ideally if i could read the NOR status register, i'd do the memcpy here
@@ -74,6 +72,7 @@ class R4iSDHC : Flashcart {
             }
 
             ++retry;
+            ++m_counters.busy_polls;
             logMessage(LOG_WARN, "r4isdhc: norErase4k: start or end isn't FF");
             ncgc::delay(41000000);
         }
@@ -84,11 +83,11 @@ class R4iSDHC : Flashcart {
     bool norWrite256(const uint32_t address, const void *src) {
         const uint8_t *bytes = static_cast<const uint8_t *>(src);
         norWriteEnable();
-        m_card->sendCommand(norCmd(0, 6, 2, address, bytes[0], bytes[1]), nullptr, 4, 0x180000);
+        sendCommand(norCmd(0, 6, 2, address, bytes[0], bytes[1]), nullptr, 4, 0x180000);
         for (uint32_t cur = 2; cur < 0x100; cur += 2) {
-            m_card->sendCommand(norRaw(bytes[cur], bytes[cur+1]), nullptr, 4, 0x180000);
+            sendCommand(norRaw(bytes[cur], bytes[cur+1]), nullptr, 4, 0x180000);
         }
-        m_card->sendCommand(norRaw(bytes[0], bytes[1], 0xF0), nullptr, 4, 0x180000);
+        sendCommand(norRaw(bytes[0], bytes[1], 0xF0), nullptr, 4, 0x180000);
         ncgc::delay(0x60000);
 
         return true;
@@ -99,7 +98,7 @@ class R4iSDHC : Flashcart {
         // this is actually the NOR write disable command
         // the r4isdhc will respond to cart commands with 0xFFFFFFFF if
         // the "magic" command hasn't been sent, so we check for that
-        m_card->sendCommand(0x40199, buf.u8, 4, 0x180000);
+        sendCommand(0x40199, buf.u8, 4, 0x180000);
         if (m_card->state() == ncgc::NTRState::Raw) {
             if (buf.u32 != 0xFFFFFFFF) {
                 logMessage(LOG_ERR, "r4isdhc: checkCartType1: pre-test returned 0x%08X", buf.u32);
@@ -114,10 +113,10 @@ class R4iSDHC : Flashcart {
         }
 
         // only type 1 carts support 0x68 command
-        m_card->sendCommand(0x68, nullptr, 4, 0x180000, true);
+        sendCommand(0x68, nullptr, 4, 0x180000, true);
 
         // now it will return zeroes
-        m_card->sendCommand(0x40199, buf.u8, 4, 0x180000, true);
+        sendCommand(0x40199, buf.u8, 4, 0x180000, true);
         if (buf.u32 == 0) {
             m_card->state(ncgc::NTRState::Raw);
             return true;
@@ -136,8 +135,8 @@ class R4iSDHC : Flashcart {
         }
 
         CmdBuf4 buf;
-        m_card->sendCommand(0x66, nullptr, 4, 0x586000, true);
-        m_card->sendCommand(0x40199, buf.u8, 4, 0x180000, true);
+        sendCommand(0x66, nullptr, 4, 0x586000, true);
+        sendCommand(0x40199, buf.u8, 4, 0x180000, true);
 
         // FIXME this is a really poor check
         // a non-r4isdhc cart will stay in KEY2 and likely return something that isn't all-FF
@@ -153,6 +152,7 @@ class R4iSDHC : Flashcart {
     }
 
     bool trySecureInit(BlowfishKey key) {
+        FLASH_SPAN("secure init");
         ncgc::Err err = m_card->init();
         if (err && !err.unsupported()) {
             logMessage(LOG_ERR, "r4isdhc: trySecureInit: ntrcard::init failed");
@@ -184,6 +184,7 @@ class R4iSDHC : Flashcart {
     uint8_t cart_type;
 
     using Util = FlashUtil<R4iSDHC, 2, &R4iSDHC::norRead, 12, &R4iSDHC::norErase4k, 8, &R4iSDHC::norWrite256>;
+    friend Util;
 
 public:
     // Name & Size of Flash Memory
@@ -244,6 +245,31 @@ public:
 
     void shutdown() { }
 
+    size_t getScratchSize() override {
+        return Util::scratchSize;
+    }
+
+    uint32_t getEraseSize() override {
+        return Util::eraseSize;
+    }
+
+    CostModel getCostModel() override {
+        // the NOR status can't be read, so erases and programs take the fixed delays in norErase4k
+        // and norWrite256, about 0.6s and 12ms. A program is WREN, the command, 127 raw commands
+        // and the commit; an erase checks two words after it.
+        // Besides the FIRM, injectNtrBoot rewrites about 12 sectors at the start and end of the flash
+        CostModel model;
+        model.read_size = 4;
+        model.erase_commands = 4;
+        model.erase = 618000;
+        model.program_size = 0x100;
+        model.program_commands = 130;
+        model.program = 11800;
+        model.inject_address = 0x7E00;
+        model.inject_extra = 0xC000;
+        return model;
+    }
+
     bool readFlash(const uint32_t address, const uint32_t length, uint8_t *const buffer) override {
         return Util::read(this, address, length, buffer, true);
     }
@@ -265,21 +291,20 @@ public:
         uint8_t map[0x100] = {0};
         // set the 2nd ROM map to some high value (0x7FFFFFFF in big-endian)
         map[4] = 0x7F; map[5] = 0xFF; map[6] = 0xFF; map[7] = 0xFF;
-        return
-            // 1:1 map the ROM <=> NOR (unless it's an "old" cart - those don't seem to have
-            // a mapping in the NOR)
-            Util::write(this, 0x1000, 0x48, blowfish_key, true, "Writing Blowfish key (1)") && // blowfish P array
-            Util::write(this, 0x2000, 0x1000, blowfish_key+0x48, true, "Writing Blowfish key (2)") && // blowfish S boxes
-            (
-                (cart_type == 1 && Util::write(this, 0x40, 0x100, map, true, "Writing ROM <=> NOR map")) ||
-                (cart_type == 2 && true) // type 2 not need ROM-NOR map
-            ) &&
-            Util::write(this, 0x1F1000, 0x48, blowfish_key, true, "Writing Blowfish key (3)") && // blowfish P array
-            Util::write(this, 0x1F2000, 0x1000, blowfish_key+0x48, true, "Writing Blowfish key (4)") && // blowfish S boxes
-            Util::write(this, 0x7E00, firm_size, firm, true, "Writing FIRM (1)") && // FIRM
+        FlashSegment segments[] = {
+            { 0x1000, 0x48, blowfish_key }, // blowfish P array
+            { 0x2000, 0x1000, blowfish_key+0x48 }, // blowfish S boxes
+            { 0x1F1000, 0x48, blowfish_key }, // blowfish P array
+            { 0x1F2000, 0x1000, blowfish_key+0x48 }, // blowfish S boxes
+            { 0x7E00, firm_size, firm }, // FIRM
             // type2 carts read 0x8000-0x10000 from 0x1F8000-0x200000 instead of from 0x8000
-            Util::write(this, 0x1F7E00, std::min<uint32_t>(firm_size, (cart_type == 1 ? 0x200 : 0x8200)), firm, true,
-                "Writing FIRM (2)"); // FIRM header
+            { 0x1F7E00, std::min<uint32_t>(firm_size, (cart_type == 1 ? 0x200 : 0x8200)), firm }, // FIRM header
+            // 1:1 map the ROM <=> NOR (unless it's an "old" cart - those don't seem to have
+            // a mapping in the NOR); type 2 doesn't need the map
+            { 0x40, 0x100, map }
+        };
+        const std::size_t count = sizeof(segments) / sizeof(segments[0]) - (cart_type == 1 ? 0 : 1);
+        return Util::writeMany(this, segments, count, true, "Writing ntrboot");
     }
 };
 
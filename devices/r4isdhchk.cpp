@@ -2,13 +2,11 @@
 #include <algorithm>
 
 #include "../device.h"
+#include "../kernels.h"
 
 #define BIT(n) (1 << (n))
 
 namespace flashcart_core {
-using platform::logMessage;
-using platform::showProgress;
-
 class R4iSDHCHK : Flashcart {
 private:
     static const uint8_t cmdGetSWRev[8];
@@ -25,31 +23,11 @@ private:
     static uint32_t sw_rev;
 
     uint8_t encrypt(uint8_t dec) {
-        uint8_t enc = 0;
-        if (dec & BIT(0)) enc |= BIT(5);
-        if (dec & BIT(1)) enc |= BIT(4);
-        if (dec & BIT(2)) enc |= BIT(1);
-        if (dec & BIT(3)) enc |= BIT(3);
-        if (dec & BIT(4)) enc |= BIT(6);
-        if (dec & BIT(5)) enc |= BIT(7);
-        if (dec & BIT(6)) enc |= BIT(0);
-        if (dec & BIT(7)) enc |= BIT(2);
-        enc ^= 0x98;
-        return enc;
+        return kernels::r4isdhchkEncrypt(dec);
     }
 
     uint8_t decrypt(uint8_t enc) {
-        uint8_t dec = 0;
-        enc ^= 0x98;
-        if (enc & BIT(0)) dec |= BIT(6);
-        if (enc & BIT(1)) dec |= BIT(2);
-        if (enc & BIT(2)) dec |= BIT(7);
-        if (enc & BIT(3)) dec |= BIT(3);
-        if (enc & BIT(4)) dec |= BIT(1);
-        if (enc & BIT(5)) dec |= BIT(0);
-        if (enc & BIT(6)) dec |= BIT(4);
-        if (enc & BIT(7)) dec |= BIT(5);
-        return dec;
+        return kernels::r4isdhchkDecrypt(enc);
     }
 
     void encrypt_memcpy(uint8_t * dst, uint8_t * src, uint32_t length) {
@@ -81,7 +59,7 @@ private:
       cmdbuf[3] = (address >>  8) & 0xFF;
       cmdbuf[4] = (address >>  0) & 0xFF;
 
-      m_card->sendCommand(cmdbuf, resp, 0x200, 80);
+      sendCommand(cmdbuf, resp, 0x200, 80);
     }
 
     void wait_flash_busy(void) {
@@ -90,11 +68,13 @@ private:
       memcpy(cmdbuf, cmdWaitFlashBusy, 8);
 
       do {
-          m_card->sendCommand(cmdbuf, (uint8_t *)&resp, 4, 80);
+          sendCommand(cmdbuf, (uint8_t *)&resp, 4, 80);
+          ++m_counters.busy_polls;
       } while(resp);
     }
 
     void erase_cmd(uint32_t address) {
+        FLASH_SPAN("erase");
         uint8_t cmdbuf[8];
         logMessage(LOG_DEBUG, "r4isdhc.hk: erase(0x%08x)", address);
         memcpy(cmdbuf, cmdEraseFlash, 8);
@@ -102,7 +82,8 @@ private:
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        m_card->sendCommand(cmdbuf, nullptr, 0, 80);
+        sendCommand(cmdbuf, nullptr, 0, 80);
+        countErase(0x10000);
         wait_flash_busy();
     }
 
@@ -115,11 +96,13 @@ private:
         cmdbuf[3] = (address >>  0) & 0xFF;
         cmdbuf[4] = value;
 
-        m_card->sendCommand(cmdbuf, nullptr, 0, 80);
+        sendCommand(cmdbuf, nullptr, 0, 80);
+        ++m_counters.programs;
         wait_flash_busy();
     }
 
     bool trySecureInit(BlowfishKey key) {
+        FLASH_SPAN("secure init");
         ncgc::Err err = m_card->init();
         if (err && !err.unsupported()) {
             logMessage(LOG_ERR, "r4isdhc.hk: trySecureInit: ntrcard::init failed");
@@ -147,16 +130,33 @@ private:
         return true;
     }
 
-    void injectFlash(uint32_t chunk_addr, uint32_t chunk_length, uint32_t offset, uint8_t *src, uint32_t src_length, bool encryption) {
-        uint8_t *chunk = (uint8_t *)malloc(chunk_length);
-        readFlash(chunk_addr, chunk_length, chunk);
-        if (encryption) {
-            encrypt_memcpy(chunk + offset, src, src_length);
-        } else {
-            memcpy(chunk + offset, src, src_length);
+    /*writes `length` bytes of `buffer` at `address`, starting from `resume` in the current journal*/
+    bool writeBlocks(uint32_t address, uint32_t length, const uint8_t *buffer, uint32_t resume) {
+        m_counters.bytes_requested += length;
+        /*one block at a time, so the journal only holds finished blocks*/
+        for (uint32_t addr=resume - address; addr < length; addr+=0x10000) {
+            erase_cmd(address + addr);
+            showProgress(addr, length, "Erasing");
+
+            const uint32_t block_length = std::min<uint32_t>(0x10000, length - addr);
+            {
+                FLASH_SPAN("program");
+                for (uint32_t i=addr; i < addr + block_length; i++) {
+                    /*the write command encrypts whatever you send it before actually writing to flash*/
+                    /*so we decrypt whatever we send to be written*/
+                    uint8_t byte = decrypt(buffer[i]);
+                    write_cmd(address + i, byte);
+                    showProgress(i,length, "Writing");
+                }
+            }
+
+            if (!verifyFlash(address + addr, block_length, buffer + addr, 0x10000, 0x200))
+                return false;
+            updateJournal(address + addr + block_length);
         }
-        writeFlash(chunk_addr, chunk_length, chunk);
-        free(chunk);
+
+        endJournal();
+        return true;
     }
 
 public:
@@ -175,6 +175,16 @@ public:
                " * R4iTT 3DS (r4itt.net)\n";
     }
 
+    uint32_t getEraseSize() { return 0x10000; }
+    // injectNtrBoot only rewrites the first 64K, whatever the FIRM size
+    CostModel getCostModel() {
+        CostModel model;
+        model.erase_commands = 1;
+        model.program_commands = 1;
+        model.rewrites_blocks = false;
+        return model;
+    }
+
     bool initialize() {
         logMessage(LOG_INFO, "r4isdhc.hk: Init");
 
@@ -189,23 +199,23 @@ public:
 
         //this is how the updater does it. Not sure exactly what it's for
         do {
-          m_card->sendCommand(cmdGetCartUniqueKey, resp1, 0x200, 80);
-          m_card->sendCommand(cmdGetCartUniqueKey, resp2, 0x200, 80);
+          sendCommand(cmdGetCartUniqueKey, resp1, 0x200, 80);
+          sendCommand(cmdGetCartUniqueKey, resp2, 0x200, 80);
           logMessage(LOG_DEBUG, "resp1: 0x%08x, resp2: 0x%08x", *resp1, *resp2);
         } while(std::memcmp(resp1, resp2, 0x200));
 
-        m_card->sendCommand(cmdGetSWRev, &sw_rev, 4, 80);
+        sendCommand(cmdGetSWRev, &sw_rev, 4, 80);
 
         logMessage(LOG_INFO, "r4isdhc.hk: Current Software Revision: %08x", sw_rev);
 
-        m_card->sendCommand(cmdUnkD0AA, nullptr, 4, 80);
-        m_card->sendCommand(cmdUnkD0AA, nullptr, 4, 80);
-        m_card->sendCommand(cmdGetChipID, nullptr, 0, 80);
-        m_card->sendCommand(cmdUnkD0AA, nullptr, 4, 80);
+        sendCommand(cmdUnkD0AA, nullptr, 4, 80);
+        sendCommand(cmdUnkD0AA, nullptr, 4, 80);
+        sendCommand(cmdGetChipID, nullptr, 0, 80);
+        sendCommand(cmdUnkD0AA, nullptr, 4, 80);
 
         do {
-          m_card->sendCommand(cmdGetCartUniqueKey, resp1, 0x200, 80);
-          m_card->sendCommand(cmdGetCartUniqueKey, resp2, 0x200, 80);
+          sendCommand(cmdGetCartUniqueKey, resp1, 0x200, 80);
+          sendCommand(cmdGetCartUniqueKey, resp2, 0x200, 80);
         } while(std::memcmp(resp1, resp2, 0x200));
         
         switch (sw_rev) {
@@ -245,20 +255,7 @@ public:
 
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer) {
         logMessage(LOG_INFO, "r4isdhc.hk: writeFlash(addr=0x%08x, size=0x%x)", address, length);
-        for (uint32_t addr=0; addr < length; addr+=0x10000) {
-           erase_cmd(address + addr);
-           showProgress(addr, length, "Erasing");
-        }
-
-        for (uint32_t i=0; i < length; i++) {
-            /*the write command encrypts whatever you send it before actually writing to flash*/
-            /*so we decrypt whatever we send to be written*/
-            uint8_t byte = decrypt(buffer[i]);
-            write_cmd(address + i, byte);
-            showProgress(i,length, "Writing");
-        }
-
-        return true;
+        return writeBlocks(address, length, buffer, beginJournal(address, length, buffer));
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) {
@@ -267,12 +264,26 @@ public:
         uint32_t buf_size = PAGE_ROUND_UP(firm_size - 0x200 + 0x000000, 0x10000);
         uint8_t gameHeader[0x200];
 
+        /*the sw revision picks the header patch; block 0 as read back changes once the inject starts*/
+        uint32_t id = journalHash(&sw_rev, sizeof(sw_rev));
+        id = journalHash(blowfish_key, 0x1048, id);
+        id = journalHash(&firm_size, sizeof(firm_size), id);
+        id = journalHash(firm, firm_size, id);
+
         logMessage(LOG_INFO, "r4isdhc.hk: Patch firmware (header)");
-        readFlash(0, 0x10000, block_0);
+        // block 0 and the game header are read, then block 0 is erased and written
+        beginProgress("Injecting ntrboot", 0x10000 + 0x200 + 2 * 0x10000);
+        uint32_t resume;
+        if (!beginInjectJournal(id, 0, 0x10000, block_0, resume)) {
+            endProgress();
+            free(block_0);
+            return false;
+        }
 
         switch (sw_rev) {
             case 0x00000505:
                 /*placeholder if going to be supported in the future. There are no reports that this revision currently exists.*/
+                endProgress();
                 return false;
             case 0x00000605: {
                 /*Modify the PicoBlaze 3 instruction (aka cart header) to remap the following in flash:*/
@@ -330,6 +341,7 @@ public:
             }
             default:
                 logMessage(LOG_ERR, "r4isdhc.hk: 0x%08x is not a recognized version and therefore is not supported.", sw_rev);
+                endProgress();
                 return false;
         }
 
@@ -339,10 +351,11 @@ public:
         memcpy(block_0 + 0x3EA8, firm, 0x200);
         memcpy(block_0 + 0x5000, firm + 0x200, firm_size - 0x200);
         encrypt_memcpy(block_0 + 0x1200, block_0 + 0x1200, 0xEE00);
-        injectFlash(0, 0x10000, 0, block_0, 0x10000, false);
+        bool result = writeBlocks(0, 0x10000, block_0, resume);
+        endProgress();
         
         free(block_0);
-        return true;
+        return result;
     }
 };
 
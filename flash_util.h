@@ -1,10 +1,65 @@
+#include <algorithm>
 #include <cstdint>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
 
+#include "kernels.h"
+
 namespace flashcart_core {
 
+/// One piece of a `FlashUtil::writeMany`.
+struct FlashSegment {
+    std::uint32_t address;
+    std::uint32_t length;
+    const void *src;
+};
+
+/// Erase sectors of `(1 << sizePower)` bytes all over the flash; the `FlashUtil` default.
+template<unsigned int sizePower>
+struct UniformSectors {
+    static constexpr std::uint32_t largest = (1 << sizePower);
+    static constexpr std::uint32_t smallest = largest;
+
+    /// Returns whether every sector is made of whole `unit`-byte pages.
+    static constexpr bool aligned(const std::uint32_t unit) { return largest % unit == 0; }
+
+    /// Returns the sector holding `address`.
+    template<typename FlashcartClass>
+    static FlashSector find(FlashcartClass *, const std::uint32_t address) {
+        return { address & ~(largest - 1), largest };
+    }
+};
+
+/// Erase sectors that vary over the flash, or from chip to chip, as the cart's `getEraseSector` has them.
+///
+/// None may be bigger than `largestSize` bytes or cross a multiple of it, and all must be whole
+/// multiples of `unit` bytes; carts check their tables of sizes with `fits`.
+template<std::uint32_t largestSize, std::uint32_t unit>
+struct CartSectors {
+    static constexpr std::uint32_t largest = largestSize;
+    static constexpr std::uint32_t smallest = unit;
+
+    /// Returns whether every sector is made of whole `page`-byte pages.
+    static constexpr bool aligned(const std::uint32_t page) { return unit % page == 0; }
+
+    /// Returns whether a table of sector sizes, as `sectorLayout` takes them, keeps to these bounds.
+    /// The last size repeats, so it has to divide `largestSize` and start on a multiple of itself.
+    template<std::size_t count>
+    static constexpr bool fits(const std::uint32_t (&sizes)[count], const std::size_t i = 0, const std::uint32_t start = 0) {
+        return i == count || (sizes[i] && sizes[i] <= largest && sizes[i] % unit == 0
+            && start % largest + sizes[i] <= largest
+            && (i + 1 < count || (largest % sizes[i] == 0 && start % sizes[i] == 0))
+            && fits(sizes, i + 1, start + sizes[i]));
+    }
+
+    /// Returns the sector holding `address`.
+    template<typename FlashcartClass>
+    static FlashSector find(FlashcartClass *const fc, const std::uint32_t address) {
+        return fc->getEraseSector(address);
+    }
+};
+
 template<
             typename FlashcartClass, 
             unsigned int readSizePower,
@@ -13,45 +68,262 @@ template<
             /// `size` is guaranteed to always be `(1 << readSizePower)`, if `readSizePower`
             /// is not 0. There are no alignment guarantees for `addr`.
             bool (FlashcartClass::*readFn)(std::uint32_t addr, std::uint32_t size, void *dest),
+            /// Size of the largest erase sector.
             unsigned int eraseSizePower,
-            /// Erases a `(1 << eraseSizePower)`-byte page at address `addr`.
+            /// Erases the sector starting at address `addr`.
             ///
-            /// `addr` is guaranteed to be aligned to `(1 << eraseSizePower)` bytes.
+            /// `addr` is guaranteed to be the start of a sector, as `Sectors` has them.
             bool (FlashcartClass::*eraseFn)(std::uint32_t addr),
             unsigned int writeSizePower,
             /// Writes a `(1 << writeSizePower)`-byte page at address `addr`.
             ///
             /// `addr` is guaranteed to be aligned to `(1 << writeSizePower)` bytes.
-            bool (FlashcartClass::*writeFn)(std::uint32_t addr, const void *src)
+            bool (FlashcartClass::*writeFn)(std::uint32_t addr, const void *src),
+            /// Where the erase sectors are: `UniformSectors`, or `CartSectors` for carts
+            /// with a `SectorLayout`.
+            typename Sectors = UniformSectors<eraseSizePower>,
+            /// Waits for the erases `eraseFn` started, on carts that queue them and run them together.
+            ///
+            /// The sectors of an erase page that need erasing are erased back to back, and then
+            /// this is called before anything else.
+            bool (FlashcartClass::*endEraseFn)() = nullptr
         >
 class FlashUtil {
-    static constexpr std::uint32_t readSize = (1 << readSizePower);
+public:
+    /// Size of the largest erase sector, and of the page buffer `write` works in.
     static constexpr std::uint32_t eraseSize = (1 << eraseSizePower);
-    static constexpr std::uint32_t eraseSizeM1 = eraseSize - 1;
+
+private:
+    static constexpr std::uint32_t readSize = (1 << readSizePower);
     static constexpr std::uint32_t writeSize = (1 << writeSizePower);
 
     static_assert(eraseSizePower >= writeSizePower, "Erase page size must be at least write page size");
+    static_assert(eraseSizePower >= readSizePower, "Erase page size must be at least read page size");
+    static_assert(Sectors::largest <= eraseSize, "Erase sectors must fit in an erase page");
+    static_assert(Sectors::aligned(writeSize) && Sectors::aligned(readSize),
+        "Erase sectors must be made of whole read and write pages");
+    static_assert(eraseSize % Sectors::largest == 0 && eraseSize / Sectors::smallest <= 64,
+        "Erase pages must hold whole sectors, 64 of them at most");
+
+    /// Bounce buffer for reads that end partway through a read page.
+    static constexpr std::uint32_t bounceSize = readSize == 1 ? 0 : readSize;
 
-    /// Writes a `(1 << eraseSizePower)`-byte page at address `dest_address`.
-    static bool writeHelper(FlashcartClass *const fc, const std::uint32_t dest_address, const std::uint8_t *const src) {
+    /// Returns the cart's scratch arena, or `nullptr` if it has none big enough.
+    ///
+    /// The arena holds the erase page being written and one to read it back into,
+    /// followed by the read bounce buffer.
+    static std::uint8_t *scratch(FlashcartClass *const fc) {
+        return fc->m_scratch_size >= scratchSize ? fc->m_scratch : nullptr;
+    }
+
+    /// Writes the `size`-byte sector at address `dest_address`.
+    ///
+    /// The sector must have just been erased; write pages that are all 0xFF are skipped.
+    static bool writeHelper(FlashcartClass *const fc, const std::uint32_t dest_address, const std::uint8_t *const src,
+                            const std::uint32_t size) {
         std::uint32_t cur = 0;
 
-        while (cur < eraseSize) {
-            if (!(fc->*writeFn)(dest_address + cur, src + cur)) {
-                return false;
+        while (cur < size) {
+            if (kernels::isErased(src + cur, writeSize)) {
+                ++fc->m_counters.skipped_pages;
+            } else {
+                ++fc->m_counters.programs;
+                if (!(fc->*writeFn)(dest_address + cur, src + cur)) {
+                    return false;
+                }
             }
 
-            // invariant: eraseSize % writeSize == 0
+            // invariant: size % writeSize == 0
             cur += writeSize;
         }
 
-        return cur == eraseSize;
+        return cur == size;
+    }
+
+    /// Copies the parts of `segments` that fall in `[start, end)` of the erase page at `page_address`
+    /// into `buf`, which holds that page. Returns whether that changed anything.
+    static bool overlay(std::uint8_t *const buf, const std::uint32_t page_address,
+                        const FlashSegment *const segments, const std::size_t count,
+                        const std::uint32_t start, const std::uint32_t end) {
+        bool changed = false;
+
+        for (std::size_t i = 0; i < count; ++i) {
+            const std::uint32_t seg_start = std::max<std::uint32_t>(segments[i].address, page_address + start);
+            const std::uint32_t seg_end = std::min<std::uint32_t>(segments[i].address + segments[i].length, page_address + end);
+            if (seg_start >= seg_end) {
+                continue;
+            }
+
+            std::uint8_t *const dest = buf + (seg_start - page_address);
+            const std::uint8_t *const src = static_cast<const std::uint8_t *>(segments[i].src) + (seg_start - segments[i].address);
+            changed |= kernels::copyIfChanged(dest, src, seg_end - seg_start);
+        }
+
+        return changed;
+    }
+
+    /// Programs `segments` over the `size`-byte sector at `page_address` without erasing it first.
+    /// `buf` holds the sector's current contents.
+    ///
+    /// Only write pages whose contents change are programmed.
+    static bool programHelper(FlashcartClass *const fc, const std::uint32_t page_address, const std::uint32_t size,
+                              std::uint8_t *const buf, const FlashSegment *const segments, const std::size_t count) {
+        for (std::uint32_t cur = 0; cur < size; cur += writeSize) {
+            if (!overlay(buf, page_address, segments, count, cur, cur + writeSize)) {
+                continue;
+            }
+
+            ++fc->m_counters.programs;
+            if (!(fc->*writeFn)(page_address + cur, buf + cur)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /// Calls `fn(attempt)` until it succeeds or the cart's retry budget runs out, logging
+    /// each retry and waiting the policy's backoff, doubled every time, before it.
+    template<typename Fn>
+    static bool withRetries(FlashcartClass *const fc, const char *const what, const std::uint32_t address, Fn fn) {
+        std::uint32_t backoff = fc->m_retry.backoff;
+
+        for (std::uint32_t attempt = 0; ; ++attempt) {
+            if (fn(attempt)) {
+                return true;
+            }
+            if (attempt >= fc->m_retry.retries) {
+                return false;
+            }
+
+            logMessage(LOG_WARN, "FlashUtil: %s at 0x%08X failed, retrying (%u of %u)",
+                what, address, attempt + 1, fc->m_retry.retries);
+            if (backoff) {
+                ncgc::delay(backoff);
+                backoff = backoff > UINT32_MAX / 2 ? UINT32_MAX : backoff * 2;
+            }
+        }
+    }
+
+    /// Writes `segments` into the `size`-byte sector at `page_address` and reads them back.
+    ///
+    /// `buf` holds the sector's current contents, and holds what it should contain after this
+    /// returns, so a failed sector can be written again with `erase` set. The sector is erased
+    /// first if `erase` is set, and is blank if `erased` is. The readback goes to `check`.
+    static bool writeSector(FlashcartClass *const fc, const std::uint32_t page_address, const std::uint32_t size,
+                            std::uint8_t *const buf, std::uint8_t *const check,
+                            const FlashSegment *const segments, const std::size_t count,
+                            const bool erase, const bool erased) {
+        FLASH_SPAN("write sector");
+        if (erase && !(eraseSector(fc, page_address, size) && endErases(fc))) {
+            return false;
+        }
+
+        if (!programSector(fc, page_address, size, buf, segments, count, erased)) {
+            overlay(buf, page_address, segments, count, 0, size);
+            logMessage(LOG_ERR, "FlashUtil::write: program failed");
+            return false;
+        }
+
+        return verifySector(fc, page_address, size, buf, check, segments, count);
+    }
+
+    static bool eraseSector(FlashcartClass *const fc, const std::uint32_t page_address, const std::uint32_t size) {
+        FLASH_SPAN("erase");
+        fc->countErase(size);
+        if (!(fc->*eraseFn)(page_address)) {
+            logMessage(LOG_ERR, "FlashUtil::write: erase failed");
+            return false;
+        }
+
+        return true;
+    }
+
+    /// Waits for the erases `eraseSector` started, if the cart has an `endEraseFn`.
+    static bool endErases(FlashcartClass *const fc) {
+        if (endEraseFn && !(fc->*endEraseFn)()) {
+            logMessage(LOG_ERR, "FlashUtil::write: erase failed");
+            return false;
+        }
+
+        return true;
+    }
+
+    /// Programs `segments` over the sector, which was just erased if `erased` is set.
+    static bool programSector(FlashcartClass *const fc, const std::uint32_t page_address, const std::uint32_t size,
+                              std::uint8_t *const buf, const FlashSegment *const segments, const std::size_t count,
+                              const bool erased) {
+        FLASH_SPAN("program");
+        if (!erased) {
+            return programHelper(fc, page_address, size, buf, segments, count);
+        }
+
+        overlay(buf, page_address, segments, count, 0, size);
+        return writeHelper(fc, page_address, buf, size);
+    }
+
+    static bool verifySector(FlashcartClass *const fc, const std::uint32_t page_address, const std::uint32_t size,
+                             const std::uint8_t *const buf, std::uint8_t *const check,
+                             const FlashSegment *const segments, const std::size_t count) {
+        FLASH_SPAN("verify");
+        for (std::size_t i = 0; i < count; ++i) {
+            if (!fc->verifySpans(segments[i].address, segments[i].length, page_address, size, readSize,
+                    [fc, buf, check, page_address](std::uint32_t span, std::uint32_t span_length) {
+                        return read(fc, span, span_length, check + (span - page_address))
+                            && !std::memcmp(check + (span - page_address), buf + (span - page_address), span_length);
+                    })) {
+                logMessage(LOG_NOTICE, "Flash write verification failed at 0x%08X", page_address);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /// Calls `fn(sector, in_sector, in_sector_count)`, with the segments that touch it, for each
+    /// sector from `address` to the end of its erase page that `segments` touch, while `fn` returns true.
+    template<typename Fn>
+    static bool eachSector(FlashcartClass *const fc, const std::uint32_t address,
+                           const FlashSegment *const segments, const std::size_t count, Fn fn) {
+        const std::uint32_t page_end = (address & ~(eraseSize - 1)) + eraseSize;
+        std::uint32_t sector_address = address;
+        std::size_t first = 0;
+
+        while (true) {
+            while (first < count && (!segments[first].length
+                    || segments[first].address + segments[first].length <= sector_address)) {
+                ++first;
+            }
+            if (first == count) {
+                return true;
+            }
+
+            const FlashSector sector = Sectors::find(fc, std::max<std::uint32_t>(sector_address, segments[first].address));
+            if (sector.start >= page_end) {
+                return true;
+            }
+            std::size_t last = first;
+            while (last < count && segments[last].address < sector.start + sector.size) {
+                ++last;
+            }
+            if (!fn(sector, segments + first, last - first)) {
+                return false;
+            }
+            sector_address = sector.start + sector.size;
+        }
     }
 
 public:
+    /// Size of the scratch arena `read` and `write` use instead of the heap.
+    ///
+    /// Carts given an arena at least this big with `Flashcart::setScratchArena`
+    /// read, write and verify without any heap allocations.
+    static constexpr std::uint32_t scratchSize = 2 * eraseSize + bounceSize;
+
     static bool read(FlashcartClass *const fc, 
                      const std::uint32_t start_address, const std::uint32_t length, void *const destVoid,
                      const bool progress = false, const char *const progress_str = "Reading flash") {
+        FLASH_SPAN("read");
         constexpr bool freeReadSize = readSize == 1;
         constexpr std::uint32_t blockSize = freeReadSize ? 0x1000 : readSize;
         std::uint8_t *const dest = static_cast<std::uint8_t *>(destVoid);
@@ -65,21 +337,25 @@ public:
         }
         
         if (progress) {
-            platform::showProgress(cur, length, progress_str);
+            fc->showProgress(cur, length, progress_str);
         }
 
+        std::uint8_t *const arena = scratch(fc);
+
         while (cur < length) {
             const std::uint32_t cur_blockSize = std::min<std::uint32_t>(blockSize, length - cur);
             const bool oddBlock = cur_blockSize != blockSize && !freeReadSize;
+            const bool heapBlock = oddBlock && !arena;
 
-            std::uint8_t *const cur_dest = oddBlock ? static_cast<std::uint8_t *>(std::malloc(blockSize)) : dest + cur;
+            std::uint8_t *const cur_dest = !oddBlock ? dest + cur
+                : arena ? arena + 2 * eraseSize : static_cast<std::uint8_t *>(std::malloc(blockSize));
             if (!cur_dest) {
-                platform::logMessage(LOG_ERR, "FlashUtil::read: malloc failed");
+                logMessage(LOG_ERR, "FlashUtil::read: malloc failed");
                 return false;
             }
 
             if (!(fc->*readFn)(start_address + cur, freeReadSize ? cur_blockSize : blockSize, cur_dest)) {
-                if (oddBlock) {
+                if (heapBlock) {
                     std::free(cur_dest);
                 }
                 return false;
@@ -87,13 +363,15 @@ public:
 
             if (oddBlock) {
                 std::memcpy(dest + cur, cur_dest, cur_blockSize);
+            }
+            if (heapBlock) {
                 std::free(cur_dest);
             }
             
             cur += cur_blockSize;
 
             if (progress) {
-                platform::showProgress(cur, length, progress_str);
+                fc->showProgress(cur, length, progress_str);
             }
         }
 
@@ -103,79 +381,201 @@ public:
     static bool write(FlashcartClass *const fc,
                       const std::uint32_t dest_address, const std::uint32_t length, const void *const srcVoid,
                       bool progress = false, const char *const progress_str = "Writing flash") {
-        const std::uint32_t real_start = dest_address & ~eraseSizeM1;
-        const std::uint32_t first_page_offset = dest_address & eraseSizeM1;
-        const std::uint32_t real_length = ((length + first_page_offset) + eraseSizeM1) & ~eraseSizeM1;
-        const std::uint8_t *const src = static_cast<const std::uint8_t *>(srcVoid);
-        std::uint32_t cur = 0;
-        std::uint8_t *buf = static_cast<std::uint8_t *>(std::malloc(eraseSize));
+        FlashSegment segment = { dest_address, length, srcVoid };
+        return writeMany(fc, &segment, 1, progress, progress_str);
+    }
+
+    /// Writes several pieces of flash in one pass.
+    ///
+    /// `segments` are sorted by address in place, and must not overlap. Each erase page
+    /// is read, erased, programmed and verified at most once, however many segments touch it;
+    /// the erases that saves over writing them one at a time go into `FlashCounters::erases_saved`.
+    static bool writeMany(FlashcartClass *const fc, FlashSegment *const segments, const std::size_t count,
+                          const bool progress = false, const char *const progress_str = "Writing flash") {
+        FLASH_SPAN("write");
+        std::sort(segments, segments + count, [](const FlashSegment &a, const FlashSegment &b) {
+            return a.address < b.address;
+        });
+
+        // count the erase pages we'll touch for the progress bar, check for overlaps,
+        // and work out which journal to keep
+        std::uint32_t total = 0;
+        std::uint32_t covered = 0;
+        std::uint32_t prev_end = 0;
+        std::uint32_t journal_start = 0;
+        std::uint32_t journal_id = FlashcartClass::journalHash(nullptr, 0);
+        for (std::size_t i = 0; i < count; ++i) {
+            if (!segments[i].length) {
+                continue;
+            }
+
+            journal_id = FlashcartClass::journalHash(&segments[i].address, sizeof(segments[i].address), journal_id);
+            journal_id = FlashcartClass::journalHash(&segments[i].length, sizeof(segments[i].length), journal_id);
+            journal_id = FlashcartClass::journalHash(segments[i].src, segments[i].length, journal_id);
+            fc->m_counters.bytes_requested += segments[i].length;
+
+            if (segments[i].address < prev_end) {
+                logMessage(LOG_ERR, "FlashUtil::writeMany: segment at 0x%08X overlaps the one before it", segments[i].address);
+                return false;
+            }
+            prev_end = segments[i].address + segments[i].length;
+
+            const std::uint32_t first_page = std::max<std::uint32_t>(Sectors::find(fc, segments[i].address).start, covered);
+            if (!total) {
+                journal_start = first_page;
+            }
+            const FlashSector last_sector = Sectors::find(fc, prev_end - 1);
+            covered = last_sector.start + last_sector.size;
+            total += covered - first_page;
+        }
+
+        std::uint8_t *const arena = scratch(fc);
+        std::uint8_t *const buf = arena ? arena : static_cast<std::uint8_t *>(std::malloc(2 * eraseSize));
         if (!buf) {
-            platform::logMessage(LOG_ERR, "FlashUtil::write: malloc failed");
+            logMessage(LOG_ERR, "FlashUtil::write: malloc failed");
             return false;
         }
+        std::uint8_t *const check = buf + eraseSize;
+
+        std::uint32_t cur = 0;
+        std::uint32_t erases = 0;
+        std::uint32_t separate_erases = 0;
+        std::uint32_t page_address = 0;
+        std::size_t first = 0;
+        const std::uint32_t resume = fc->beginJournal(journal_id, journal_start, covered);
 
         if (progress) {
-            platform::showProgress(cur, real_length, progress_str);
+            fc->showProgress(cur, total, progress_str);
         }
 
-        while (cur < real_length) {
-            const std::uint32_t cur_addr = real_start + cur;
-            const std::uint32_t buf_ofs = ((dest_address > cur_addr) ? (dest_address - cur_addr) : 0);
-            const std::uint32_t src_ofs = ((cur > first_page_offset) ? (cur - first_page_offset) : 0);
-            const std::uint32_t len = std::min<std::uint32_t>(eraseSize - buf_ofs, std::min<std::uint32_t>(length - src_ofs, std::uint32_t(eraseSize)));
-
-            if (!read(fc, cur_addr, eraseSize, buf)) {
-                platform::logMessage(LOG_ERR, "FlashUtil::write: read failed");
-                goto fail;
+        while (true) {
+            // drop the segments that end before this page
+            while (first < count && (!segments[first].length
+                    || segments[first].address + segments[first].length <= page_address)) {
+                ++first;
+            }
+            if (first == count) {
+                break;
             }
 
-            if (std::memcmp(buf + buf_ofs, src + src_ofs, len)) {
-                if (!(fc->*eraseFn)(cur_addr)) {
-                    platform::logMessage(LOG_ERR, "FlashUtil::write: erase failed");
-                    goto fail;
-                }
+            page_address = std::max<std::uint32_t>(page_address, Sectors::find(fc, segments[first].address).start);
+            const std::uint32_t buf_address = page_address & ~(eraseSize - 1);
+            const FlashSegment *const in_page = segments + first;
+            const std::size_t in_page_count = count - first;
 
-                std::memcpy(buf + buf_ofs, src + src_ofs, len);
-                writeHelper(fc, cur_addr, buf);
-            }
+            // the sectors of this erase page the segments touch go through `buf` and `check` at their
+            // offsets in it, each with bit `offset / Sectors::smallest` in these
+            std::uint64_t changed = 0;
+            std::uint64_t needs_erase = 0;
+            std::uint32_t end = page_address;
 
-            cur += eraseSize;
-            if (progress) {
-                platform::showProgress(cur, real_length, progress_str);
-            }
-        }
+            // read them all, and work out which have to be erased; sectors an interrupted attempt
+            // already finished are left alone
+            if (!eachSector(fc, page_address, in_page, in_page_count,
+                    [fc, buf, buf_address, resume, &changed, &needs_erase, &end, &erases, &separate_erases](
+                        const FlashSector sector, const FlashSegment *const in_sector, const std::size_t in_sector_count) {
+                        end = sector.start + sector.size;
+                        if (sector.start < resume) {
+                            return true;
+                        }
+
+                        std::uint8_t *const sector_buf = buf + (sector.start - buf_address);
+                        if (!withRetries(fc, "read", sector.start, [fc, sector, sector_buf](std::uint32_t) {
+                                return read(fc, sector.start, sector.size, sector_buf);
+                            })) {
+                            logMessage(LOG_ERR, "FlashUtil::write: read failed");
+                            return false;
+                        }
 
-        std::free(buf);
-        buf = static_cast<uint8_t *>(std::malloc(length));
-        if (buf) {
-            if (!read(fc, dest_address, length, buf)
-                || std::memcmp(buf, src, length)) {
-                platform::logMessage(LOG_NOTICE, "Flash write verification failed");
+                        const std::uint64_t bit = std::uint64_t(1) << ((sector.start - buf_address) / Sectors::smallest);
+                        for (std::size_t i = 0; i < in_sector_count; ++i) {
+                            const std::uint32_t seg_start = std::max<std::uint32_t>(in_sector[i].address, sector.start);
+                            const std::uint32_t seg_end = std::min<std::uint32_t>(in_sector[i].address + in_sector[i].length, sector.start + sector.size);
+                            const std::uint8_t *const src = static_cast<const std::uint8_t *>(in_sector[i].src) + (seg_start - in_sector[i].address);
+                            if (seg_start >= seg_end) {
+                                continue;
+                            }
+                            if (!std::memcmp(sector_buf + (seg_start - sector.start), src, seg_end - seg_start)) {
+                                fc->m_counters.bytes_unchanged += seg_end - seg_start;
+                                continue;
+                            }
+
+                            changed |= bit;
+                            if (!kernels::onlyClearsBits(sector_buf + (seg_start - sector.start), src, seg_end - seg_start)) {
+                                // writing this segment on its own would have erased the sector too
+                                ++separate_erases;
+                                if (!(needs_erase & bit)) {
+                                    needs_erase |= bit;
+                                    ++erases;
+                                }
+                            }
+                        }
+                        return true;
+                    })) {
                 goto fail;
             }
-        } else {
-            std::uint32_t t;
-            if (!read(fc, dest_address, 4, &t)
-                || std::memcmp(&t, src, std::min<std::uint32_t>(length, 4))) {
-                platform::logMessage(LOG_NOTICE, "Flash write start verification failed");
+
+            // erase them back to back, so carts that can queue sector erases run them as one
+            if (needs_erase && !withRetries(fc, "erase", buf_address, [fc, buf_address, needs_erase](std::uint32_t) {
+                    for (std::uint32_t i = 0; i < eraseSize / Sectors::smallest; ++i) {
+                        const std::uint32_t sector_address = buf_address + i * Sectors::smallest;
+                        if ((needs_erase >> i & 1) && !eraseSector(fc, sector_address, Sectors::find(fc, sector_address).size)) {
+                            endErases(fc);
+                            return false;
+                        }
+                    }
+                    return endErases(fc);
+                })) {
                 goto fail;
             }
 
-            if (length > 4) {
-                if (!read(fc, dest_address + length - 4, 4, &t)
-                    || std::memcmp(&t, src + length - 4, 4)) {
-                    platform::logMessage(LOG_NOTICE, "Flash write start verification failed");
-                    goto fail;
-                }
+            // then program and verify them one at a time
+            if (!eachSector(fc, page_address, in_page, in_page_count,
+                    [fc, buf, check, buf_address, resume, changed, needs_erase, &cur, total, progress, progress_str](
+                        const FlashSector sector, const FlashSegment *const in_sector, const std::size_t in_sector_count) {
+                        const std::uint64_t bit = std::uint64_t(1) << ((sector.start - buf_address) / Sectors::smallest);
+                        if (sector.start >= resume) {
+                            std::uint8_t *const sector_buf = buf + (sector.start - buf_address);
+                            std::uint8_t *const sector_check = check + (sector.start - buf_address);
+                            const bool erased = needs_erase & bit;
+
+                            // a failed attempt leaves the sector in an unknown state, so retries always erase it
+                            if ((changed & bit) && !withRetries(fc, "write", sector.start,
+                                    [fc, sector, sector_buf, sector_check, in_sector, in_sector_count, erased](std::uint32_t attempt) {
+                                        return writeSector(fc, sector.start, sector.size, sector_buf, sector_check,
+                                            in_sector, in_sector_count, attempt, erased || attempt);
+                                    })) {
+                                return false;
+                            }
+
+                            fc->updateJournal(sector.start + sector.size);
+                        }
+
+                        cur += sector.size;
+                        if (progress) {
+                            fc->showProgress(cur, total, progress_str);
+                        }
+                        return true;
+                    })) {
+                goto fail;
             }
+
+            page_address = end;
+        }
+
+        fc->endJournal();
+        fc->m_counters.erases_saved += separate_erases - erases;
+        if (count > 1) {
+            logMessage(LOG_INFO, "FlashUtil::writeMany: %u erases, %u fewer than separate writes",
+                erases, separate_erases - erases);
         }
 
-        if (buf) {
+        if (!arena) {
             std::free(buf);
         }
         return true;
     fail:
-        if (buf) {
+        if (!arena) {
             std::free(buf);
         }
         return false;
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// The loops the drivers run on the CPU between card commands, kept out of the drivers
+// so `sim::runMicrobenchmarks` can time them on the host.
+namespace flashcart_core {
+namespace kernels {
+/// R4i Gold 3DS flash scrambling. `type` is the driver's `m_r4i_type`: 1 and 3 permute
+/// the bits of each byte, 2 XORs each byte with its offset plus 9.
+inline void r4iGoldEncrypt(std::uint8_t *dst, const std::uint8_t *src, std::uint32_t length, int type) {
+    for (std::uint32_t i = 0; i < length; ++i) {
+        const std::uint8_t dec = src[i];
+        std::uint8_t enc = 0;
+        switch (type) {
+            case 1: //rev9-D
+            case 3: //rev6-7 maybe 8
+                if (dec & (1 << 0)) enc |= 1 << 4;
+                if (dec & (1 << 1)) enc |= 1 << 3;
+                if (dec & (1 << 2)) enc |= 1 << 7;
+                if (dec & (1 << 3)) enc |= 1 << 6;
+                if (dec & (1 << 4)) enc |= 1 << 1;
+                if (dec & (1 << 5)) enc |= 1 << 0;
+                if (dec & (1 << 6)) enc |= 1 << 2;
+                if (dec & (1 << 7)) enc |= 1 << 5;
+                break;
+            case 2: //rev4-5
+                enc = static_cast<std::uint8_t>((i % 256) + 9) ^ dec;
+                break;
+            // FIXME throw error
+        }
+        dst[i] = enc;
+    }
+}
+
+/// r4isdhc.hk flash scrambling: a bit permutation, then XOR 0x98.
+inline std::uint8_t r4isdhchkEncrypt(const std::uint8_t dec) {
+    std::uint8_t enc = 0;
+    if (dec & (1 << 0)) enc |= 1 << 5;
+    if (dec & (1 << 1)) enc |= 1 << 4;
+    if (dec & (1 << 2)) enc |= 1 << 1;
+    if (dec & (1 << 3)) enc |= 1 << 3;
+    if (dec & (1 << 4)) enc |= 1 << 6;
+    if (dec & (1 << 5)) enc |= 1 << 7;
+    if (dec & (1 << 6)) enc |= 1 << 0;
+    if (dec & (1 << 7)) enc |= 1 << 2;
+    return enc ^ 0x98;
+}
+
+/// Undoes `r4isdhchkEncrypt`.
+inline std::uint8_t r4isdhchkDecrypt(std::uint8_t enc) {
+    std::uint8_t dec = 0;
+    enc ^= 0x98;
+    if (enc & (1 << 0)) dec |= 1 << 6;
+    if (enc & (1 << 1)) dec |= 1 << 2;
+    if (enc & (1 << 2)) dec |= 1 << 7;
+    if (enc & (1 << 3)) dec |= 1 << 3;
+    if (enc & (1 << 4)) dec |= 1 << 1;
+    if (enc & (1 << 5)) dec |= 1 << 0;
+    if (enc & (1 << 6)) dec |= 1 << 4;
+    if (enc & (1 << 7)) dec |= 1 << 5;
+    return dec;
+}
+
+/// Turns the Ace3DS+ 0xC6 response into the 0xC7 unlock block, in place.
+inline void ace3dsplusEnableFlash(std::uint32_t (&bufu32)[0x200/4]) {
+    std::uint8_t *const buf = reinterpret_cast<std::uint8_t *>(bufu32);
+
+    /*
+        result = 0;
+        v3 = v1 + 512;
+        do {
+            v4 = *v1++ & 1;
+            result = 2 * result | v4;
+        } while ( v1 != v3 );
+    */
+    // they loop over the whole 512 bytes but..
+    // an int's only 32 bits????????
+    // TODO verify this
+    std::uint32_t weird_sum = 0;
+    for (int i = 0; i < 32; ++i) {
+        if (buf[i + (0x200 - 32)] & 1) {
+            weird_sum |= (1 << (31 - i));
+        }
+    }
+
+    for (int i = 0; i < 0x200/4; ++i) {
+        if (i & 1) {
+            bufu32[i] <<= 1;
+        } else {
+            bufu32[i] >>= 1;
+        }
+    }
+
+    for (int i = 0; i < 0x200; ++i) {
+        std::uint32_t sum_lsl1 = weird_sum << 1;
+        if ((sum_lsl1 ^ weird_sum) & 0x8000) {
+            sum_lsl1 |= 1;
+        }
+        buf[i] = (sum_lsl1 & 0x8000) ? (buf[i] | 1) : (buf[i] & ~1);
+        weird_sum = sum_lsl1;
+    }
+}
+
+/// Fills the Ace3DS+ ROM-to-NOR map, both copies of it: 0x4000 entries, 0x8000 bytes.
+///
+/// map = struct.unpack("<8192H", flash[0:0x4000]) # python
+/// 0x4000:0x8000 is the map for pre-"anti-anti-piracy" (AAP)
+/// nor_address(rom_address) = (map[rom_address >> 12] << 12) + (rom_address & 0xFFF)
+inline void ace3dsplusConfigMap(std::uint16_t *configMap) {
+    for (int i = 0; i < 8; ++i) {
+        configMap[i] = 0xA;
+    }
+    for (int i = 0; i < (0x4000/2) - 8; ++i) {
+        configMap[i+8] = 0xB+i;
+    }
+    std::memcpy(configMap + 0x2000, configMap, 0x2000*2);
+}
+
+/// Returns whether `len` bytes at `src` are all 0xFF, i.e. what an erase leaves behind.
+inline bool isErased(const std::uint8_t *const src, const std::uint32_t len) {
+    for (std::uint32_t i = 0; i < len; ++i) {
+        if (src[i] != 0xFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Returns whether `len` bytes at `dest` can be turned into `src` without an erase.
+///
+/// NOR programming can only clear bits, so this holds if no bit is set in `src`
+/// that isn't already set in `dest`.
+inline bool onlyClearsBits(const std::uint8_t *const dest, const std::uint8_t *const src, const std::uint32_t len) {
+    for (std::uint32_t i = 0; i < len; ++i) {
+        if (src[i] & ~dest[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Copies `len` bytes from `src` to `dest` if they differ. Returns whether they did.
+inline bool copyIfChanged(std::uint8_t *const dest, const std::uint8_t *const src, const std::uint32_t len) {
+    if (!std::memcmp(dest, src, len)) {
+        return false;
+    }
+
+    std::memcpy(dest, src, len);
+    return true;
+}
+}
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+
+namespace flashcart_core {
+
+/// Command sequences for the AMD-style parallel NOR chips the DSTT and its clones (DSONE,
+/// DSONEi) put behind their flash command, shared by those drivers.
+///
+/// The driver keeps the state: `m_flashchip`, and `m_bypass_supported` and `m_unlock_bypass`
+/// for unlock bypass mode. It declares `friend` on its `NorChip` like it would on a `FlashUtil`.
+template<
+            typename FlashcartClass,
+            /// The cart's flash command: `data0` 0x87 writes `data2` to the chip at `data1`,
+            /// and 0 reads the 4 bytes at `data1`.
+            std::uint32_t (FlashcartClass::*commandFn)(std::uint8_t data0, std::uint32_t data1, std::uint16_t data2),
+            /// Puts the chip back in read array mode.
+            void (FlashcartClass::*resetFn)()
+        >
+class NorChip {
+public:
+    /// Status polls an erase gets to finish before it's given up on; a good 15 seconds of card
+    /// commands.
+    static constexpr std::uint32_t eraseTimeout = 0x100000;
+
+    /// Waits for the erase at `offset` to finish.
+    ///
+    /// DQ7 reads 0 until the erase is done, and then the erased byte's 1. If DQ5 goes high
+    /// first, the chip gave up; SST and Atmel parts don't have DQ5, though, so on those only
+    /// the timeout catches that. Either way the chip is reset and this returns false.
+    static bool waitErase(FlashcartClass *const fc, const std::uint32_t offset) {
+        const std::uint8_t manufacturer = static_cast<std::uint8_t>(fc->m_flashchip);
+        const bool has_dq5 = manufacturer != 0xBF && manufacturer != 0x1F;
+        FLASH_SPAN("busy-wait");
+        for (std::uint32_t polls = 0; ; ++polls) {
+            const std::uint8_t status = static_cast<std::uint8_t>((fc->*commandFn)(0, offset, 0));
+            if (status & 0x80) {
+                return true;
+            }
+            if (has_dq5 && (status & 0x20) && !((fc->*commandFn)(0, offset, 0) & 0x80)) {
+                logMessage(LOG_ERR, "%s: erase(0x%08x) failed", fc->getShortName(), offset);
+                (fc->*resetFn)();
+                return false;
+            }
+            if (polls == eraseTimeout) {
+                logMessage(LOG_ERR, "%s: erase(0x%08x) timed out", fc->getShortName(), offset);
+                (fc->*resetFn)();
+                return false;
+            }
+            ++fc->m_counters.busy_polls;
+        }
+    }
+
+    /// Returns whether `flashchip` has unlock bypass mode: after 0x5555:0xAA, 0x2AAA:0x55,
+    /// 0x5555:0x20, a byte program is just X:0xA0, PA:PD, until X:0x90, X:0x00.
+    ///
+    /// These are the AMD, Macronix and EON parts whose datasheets list it.
+    static bool supportsUnlockBypass(const std::uint32_t flashchip) {
+        switch (static_cast<std::uint16_t>(flashchip)) {
+            case 0x49C2: // MX29LV160BB
+            case 0x5BC2: // MX29LV800B
+            case 0xA7C2: // MX29LV320
+            case 0xA8C2:
+            case 0xB91C: // EN29LV400A
+            case 0xBA01: // Am29LV400BB
+            case 0xBA1C:
+            case 0xBAC2: // MX29LV400B
+            case 0xC4C2: // MX29LV160BT
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /// Puts the chip in unlock bypass mode, if the cart thinks it has one.
+    static void enterUnlockBypass(FlashcartClass *const fc) {
+        if (!fc->m_bypass_supported || fc->m_unlock_bypass) {
+            return;
+        }
+
+        logMessage(LOG_DEBUG, "%s: Unlock bypass", fc->getShortName());
+        (fc->*commandFn)(0x87, 0x5555, 0xAA);
+        (fc->*commandFn)(0x87, 0x2AAA, 0x55);
+        (fc->*commandFn)(0x87, 0x5555, 0x20);
+        fc->m_unlock_bypass = true;
+    }
+
+    /// Takes the chip out of unlock bypass mode. The chip ignores resets until then.
+    static void exitUnlockBypass(FlashcartClass *const fc) {
+        if (!fc->m_unlock_bypass) {
+            return;
+        }
+
+        (fc->*commandFn)(0x87, 0, 0x90);
+        (fc->*commandFn)(0x87, 0, 0x00);
+        fc->m_unlock_bypass = false;
+    }
+
+    /// Programs `data` at `offset` in unlock bypass mode, and waits for it.
+    ///
+    /// DQ6 toggles on every read while the chip is programming. If it reads the same twice
+    /// without the data there, the chip never took the program: it's taken out of unlock bypass
+    /// mode for good, and this returns false for the cart to program the byte the long way.
+    static bool programByte(FlashcartClass *const fc, const std::uint32_t offset, const std::uint8_t data) {
+        (fc->*commandFn)(0x87, offset, 0xA0);
+        (fc->*commandFn)(0x87, offset, data);
+
+        std::uint32_t last = (fc->*commandFn)(0, offset, 0);
+        while (static_cast<std::uint8_t>(last) != data) {
+            ++fc->m_counters.busy_polls;
+            const std::uint32_t status = (fc->*commandFn)(0, offset, 0);
+            if (static_cast<std::uint8_t>(status) == static_cast<std::uint8_t>(last)) {
+                logMessage(LOG_WARN, "%s: Flashchip 0x%04x doesn't take unlock bypass programs",
+                    fc->getShortName(), fc->m_flashchip);
+                exitUnlockBypass(fc);
+                (fc->*resetFn)();
+                fc->m_bypass_supported = false;
+                return false;
+            }
+            last = status;
+        }
+
+        return true;
+    }
+};
+}
@@ -9,6 +9,20 @@ namespace platform {
 // Allow platforms to not provide these.
 __attribute__((weak)) void showProgress(std::uint32_t current, std::uint32_t total, const char* status_string) { ; }
 
+__attribute__((weak)) void reportProgress(const ProgressEvent &event) {
+    showProgress(event.done, event.total, event.operation);
+}
+
 __attribute__((weak)) int logMessage(log_priority priority, const char *fmt, ...) { return 0; }
+
+__attribute__((weak)) bool loadJournal(std::uint32_t id, std::uint32_t &address) { return false; }
+__attribute__((weak)) void saveJournal(std::uint32_t id, std::uint32_t address) { ; }
+__attribute__((weak)) void clearJournal(std::uint32_t id) { ; }
+__attribute__((weak)) bool saveJournalData(std::uint32_t id, const void *data, std::uint32_t size) { return false; }
+__attribute__((weak)) bool loadJournalData(std::uint32_t id, void *data, std::uint32_t size) { return false; }
+
+__attribute__((weak)) std::uint64_t now() { return 0; }
+
+__attribute__((weak)) bool logEnabled(log_priority priority) { return true; }
 }
 }
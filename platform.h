@@ -16,10 +16,58 @@ enum class BlowfishKey {
     NTR, B9Retail, B9Dev
 };
 
+// A progress update, for `platform::reportProgress`.
+struct ProgressEvent {
+    const char *operation; // What the bar is for: the phase, or an operation made of several phases
+    const char *phase; // What the cart is doing now, e.g. "Writing"
+    std::uint32_t done; // Out of `total`; bytes, for most phases
+    std::uint32_t total;
+    std::uint32_t bytes_per_second; // Of `done` since the bar started; 0 without `now()`
+};
+
 // override these in platform.cpp
 namespace platform {
 void showProgress(std::uint32_t current, std::uint32_t total, const char* status_string);
 int logMessage(log_priority priority, const char *fmt, ...);
 auto getBlowfishKey(BlowfishKey key) -> const std::uint8_t(&)[0x1048];
+
+// Optional: a journal of finished erase blocks, so an interrupted write can resume
+// after re-init. `id` identifies the write, and everything before `address` in it is
+// written and verified. Keep it somewhere that survives the cart going away.
+bool loadJournal(std::uint32_t id, std::uint32_t &address);
+void saveJournal(std::uint32_t id, std::uint32_t address);
+void clearJournal(std::uint32_t id);
+// Optional: the flash an inject is rewriting, as it was before the inject began, kept under
+// the inject's journal `id` so an interrupted attempt doesn't have to read back a half-erased
+// block. `clearJournal(id)` drops it. Returns false if it can't be kept, or isn't there.
+bool saveJournalData(std::uint32_t id, const void *data, std::uint32_t size);
+bool loadJournalData(std::uint32_t id, void *data, std::uint32_t size);
+
+// Optional: a monotonic clock in microseconds, used to timestamp command traces.
+std::uint64_t now();
+
+// Optional: a richer `showProgress`. The default passes `operation` to `showProgress` as the
+// status string. Updates are already rate-limited, so it's fine to redraw on each one.
+void reportProgress(const ProgressEvent &event);
+
+// Optional: whether messages of `priority` would be kept. Checked before every message, so
+// keep it cheap; messages it turns down are never formatted or passed to `logMessage`.
+bool logEnabled(log_priority priority);
+}
+
+// Messages below this priority are compiled out, e.g. -DFLASHCART_CORE_MIN_LOG_LEVEL=LOG_INFO
+#ifndef FLASHCART_CORE_MIN_LOG_LEVEL
+#define FLASHCART_CORE_MIN_LOG_LEVEL LOG_DEBUG
+#endif
+
+/// What flashcart_core logs through: `platform::logMessage`, if the message's priority is
+/// compiled in and `platform::logEnabled` wants it. A constant priority below the minimum
+/// makes the call compile to nothing.
+template<typename... Args>
+inline int logMessage(log_priority priority, const char *fmt, Args... args) {
+    if (priority < FLASHCART_CORE_MIN_LOG_LEVEL || !platform::logEnabled(priority)) {
+        return 0;
+    }
+    return platform::logMessage(priority, fmt, args...);
 }
 }
@@ -0,0 +1,63 @@
+#include <cstring>
+
+#include "sim_card.h"
+
+namespace flashcart_core {
+namespace sim {
+ncgc::Err SimAce3DSPlus::sendSpi(const uint8_t *cmd, size_t cmd_length, uint8_t *resp, size_t resp_length) {
+    tick(cmd_length + resp_length);
+    if (resp) {
+        std::memset(resp, 0xFF, resp_length);
+    }
+    if (!cmd_length) {
+        return ncgc::Err();
+    }
+
+    const uint32_t address = cmd_length >= 4 ? be24(cmd + 1) : 0;
+    switch (cmd[0]) {
+        case 0x9F: // RDID
+            for (size_t i = 0; i < resp_length && i < 3; ++i) {
+                resp[i] = (m_jedec_id >> (8 * i)) & 0xFF;
+            }
+            break;
+        case 0x05: // RDSR: WIP, WEL
+            if (resp_length) {
+                resp[0] = (busy() ? 1 : 0) | (m_write_enabled ? 2 : 0);
+            }
+            break;
+        case 0x06: // WREN
+            m_write_enabled = true;
+            break;
+        case 0x04: // WRDI
+            m_write_enabled = false;
+            break;
+        case 0x03: // READ
+            if (!busy()) {
+                readFlash(address, resp, resp_length);
+            }
+            break;
+        case 0x20: // SE, 4K
+            if (m_write_enabled && !busy() && cmd_length >= 4) {
+                erase(address);
+            }
+            m_write_enabled = false;
+            break;
+        case 0x02: // PP, wrapping within the 256 byte page
+            if (m_write_enabled && !busy() && cmd_length > 4) {
+                const size_t length = std::min<size_t>(cmd_length - 4, 0x100);
+                for (size_t i = 0; i < length; ++i) {
+                    m_flash.program((address & ~0xFFu) | ((address + i) & 0xFF), cmd[4 + i]);
+                }
+                m_ready = m_clock + m_latency.program;
+            }
+            m_write_enabled = false;
+            break;
+        default:
+            unknownCommand(cmd, cmd_length);
+            break;
+    }
+
+    return ncgc::Err();
+}
+}
+}
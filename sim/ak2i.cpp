@@ -0,0 +1,56 @@
+#include <cstring>
+
+#include "sim_card.h"
+
+namespace flashcart_core {
+namespace sim {
+ncgc::Err SimAK2i::sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) {
+    tick(8 + size);
+    if (buf) {
+        std::memset(buf, 0, size);
+    }
+
+    static const uint8_t unlock_flash[] = {0xAA, 0x55, 0xAA, 0x55};
+    static const uint8_t lock_flash[] = {0xAA, 0xAA, 0x55, 0x55};
+    const uint32_t address = (cmd[1] & (m_hw_revision == 0x44444444 ? 0x1F : 0xFF)) << 16 | cmd[2] << 8 | cmd[3];
+    switch (cmd[0]) {
+        case 0xD1: // hardware revision
+            std::memcpy(buf, &m_hw_revision, std::min<size_t>(size, 4));
+            break;
+        case 0xC0: { // flash busy
+            const uint32_t state = busy() ? 1 : 0;
+            std::memcpy(buf, &state, std::min<size_t>(size, 4));
+            break;
+        }
+        case 0xC2: // lock and unlock; the rest are ASIC setup
+            if (!std::memcmp(cmd + 1, unlock_flash, 4)) {
+                m_unlocked = true;
+            } else if (!std::memcmp(cmd + 1, lock_flash, 4)) {
+                m_unlocked = false;
+            }
+            break;
+        case 0xD0: // map table
+        case 0xD8: // flash setup (HW-81)
+            break;
+        case 0xB7:
+            readFlash(be32(cmd + 1), buf, size);
+            break;
+        case 0xD4:
+            if (!m_unlocked || busy()) {
+                break;
+            }
+            if (cmd[5] == 0x01 || cmd[5] == 0x80) {
+                erase(address);
+            } else if (cmd[5] == 0x03 || cmd[5] == 0xA0) {
+                program(address, cmd + 4, 1);
+            }
+            break;
+        default:
+            unknownCommand(cmd, 8);
+            break;
+    }
+
+    return ncgc::Err();
+}
+}
+}
@@ -0,0 +1,163 @@
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "arena_check.h"
+#include "sim_card.h"
+#include "../flash_util.h"
+
+namespace {
+bool counting; // Only set while checkScratchArena runs an operation, so nothing else linked in is counted
+uint64_t allocations; // Heap allocations made while counting
+}
+
+#if defined(__GLIBC__)
+// Every malloc, calloc and realloc in the program, operator new's included, comes through here
+// on its way to glibc's allocator. Outside `countAllocations` they pass straight through.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) __THROW {
+    allocations += counting;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) __THROW {
+    allocations += counting;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) __THROW {
+    allocations += counting;
+    return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+namespace flashcart_core {
+namespace sim {
+namespace {
+template<typename Sim>
+SimCard *makeSim(NorFlash &flash, const SimLatency &latency) {
+    return new Sim(flash, latency);
+}
+
+SimCard *makeSimDSTT(NorFlash &flash, const SimLatency &latency) {
+    return new SimDSTT(flash, latency, 0xBA01);
+}
+
+struct ArenaCart {
+    const char *cart;
+    SimCard *(*make)(NorFlash &flash, const SimLatency &latency);
+    uint32_t flash_size;
+    std::vector<uint32_t> sectors;
+    bool initialize; // false if `initialize` needs key exchange
+};
+
+const ArenaCart arena_carts[] = {
+    { "Ace3DSPlus", makeSim<SimAce3DSPlus>, 0x200000, {0x1000}, false },
+    { "r4isdhc", makeSim<SimR4iSDHC>, 0x200000, {0x1000}, false },
+    { "DSTT", makeSimDSTT, 0x10000, {0x2000, 0x1000, 0x1000, 0x4000, 0x8000}, true },
+};
+
+Flashcart *findCart(const char *short_name) {
+    for (Flashcart *cart : *flashcart_list) {
+        if (!std::strcmp(cart->getShortName(), short_name)) {
+            return cart;
+        }
+    }
+    return nullptr;
+}
+
+/// Runs `operation`, and returns how many heap allocations it made, or -1 if it failed.
+template<typename Operation>
+int64_t countAllocations(Operation operation) {
+    allocations = 0;
+    counting = true;
+    const bool result = operation();
+    counting = false;
+    return result ? static_cast<int64_t>(allocations) : -1;
+}
+
+bool checkCart(const ArenaCart &entry, uint32_t seed) {
+    Flashcart *const cart = findCart(entry.cart);
+    if (!cart) {
+        return true;
+    }
+
+    const SimLatency latency = { 1, 0, 1, 10 };
+    NorFlash flash(entry.flash_size, entry.sectors);
+    std::unique_ptr<SimCard> sim(entry.make(flash, latency));
+    cart->setBackend(sim.get());
+    if (entry.initialize && !cart->initialize(nullptr)) {
+        logMessage(LOG_ERR, "check: %s: initialize failed", entry.cart);
+        cart->setBackend(nullptr);
+        return false;
+    }
+
+    // an odd length and address, so reads end partway through a read page
+    const uint32_t address = 0x1801, length = 0x2FFF;
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> data(length), readback(length), blowfish_key(0x1048), firm(0x4000);
+    std::vector<uint8_t> arena(cart->getScratchSize());
+
+    bool passed = true;
+    for (int use_arena = 1; use_arena >= 0; --use_arena) {
+        cart->setScratchArena(use_arena ? arena.data() : nullptr, use_arena ? arena.size() : 0);
+        for (uint8_t &byte : data) {
+            byte = rng();
+        }
+        for (uint8_t &byte : firm) {
+            byte = rng();
+        }
+
+        const int64_t write = countAllocations([&]() { return cart->writeFlash(address, length, data.data()); });
+        const int64_t read = countAllocations([&]() { return cart->readFlash(address, length, readback.data()); });
+        const int64_t inject = countAllocations([&]() {
+            return cart->injectNtrBoot(blowfish_key.data(), firm.data(), static_cast<uint32_t>(firm.size()));
+        });
+
+        const char *const problem = write < 0 || read < 0 || inject < 0 ? "an operation failed"
+            : std::memcmp(readback.data(), data.data(), length) ? "read differs from the write"
+            : use_arena && write ? "write allocated"
+            : use_arena && read ? "read allocated"
+            : use_arena && inject ? "inject allocated"
+            : !use_arena && !write ? "write without an arena didn't allocate"
+            : nullptr;
+        if (problem) {
+            logMessage(LOG_ERR, "check: %s, %s arena: %s (%" PRId64 " allocations writing, %" PRId64 " reading, %" PRId64 " injecting)",
+                entry.cart, use_arena ? "with" : "without", problem, write, read, inject);
+            passed = false;
+        }
+    }
+
+    cart->setScratchArena(nullptr, 0);
+    cart->setBackend(nullptr);
+    if (passed) {
+        logMessage(LOG_NOTICE, "check: %s: no heap allocations with a 0x%X byte scratch arena",
+            entry.cart, static_cast<unsigned int>(arena.size()));
+    }
+    return passed;
+}
+}
+
+bool checkScratchArena(uint32_t seed) {
+#if !defined(__GLIBC__)
+    logMessage(LOG_NOTICE, "check: heap allocations can't be counted on this host, scratch arena check skipped");
+    return true;
+#endif
+
+    bool passed = true;
+    for (const ArenaCart &entry : arena_carts) {
+        passed &= checkCart(entry, seed);
+    }
+
+    return passed;
+}
+}
+}
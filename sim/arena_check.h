@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+// Checks that carts given a scratch arena read and write flash without touching the heap.
+namespace flashcart_core {
+namespace sim {
+/// Reads, writes and injects through each `FlashUtil` cart with a simulator, once with a
+/// `getScratchSize()` arena and once without, counting the heap allocations each of them makes.
+///
+/// With the arena, none of them may allocate. Without it, the writes must, which shows the
+/// count works. Returns false, and logs the operation, if either doesn't hold. Hosts where the
+/// allocations can't be counted (anything but glibc) pass with a notice.
+bool checkScratchArena(uint32_t seed);
+}
+}
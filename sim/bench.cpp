@@ -0,0 +1,150 @@
+#include <cinttypes>
+#include <cstring>
+#include <memory>
+
+#include "bench.h"
+
+namespace flashcart_core {
+namespace sim {
+namespace {
+template<typename Sim>
+SimCard *makeSim(NorFlash &flash, const SimLatency &latency) {
+    return new Sim(flash, latency);
+}
+
+template<uint32_t id>
+SimCard *makeSimDSTT(NorFlash &flash, const SimLatency &latency) {
+    return new SimDSTT(flash, latency, id);
+}
+
+struct BenchCart {
+    const char *cart;
+    SimCard *(*make)(NorFlash &flash, const SimLatency &latency);
+    uint32_t flash_size;
+    std::vector<uint32_t> sectors;
+    bool initialize; // false if `initialize` needs key exchange, which the simulator can't do
+    uint32_t write_address;
+    uint32_t write_length;
+    uint32_t firm_size; // Fits every cart, and the byte-programming carts' FIRM area
+};
+
+const BenchCart bench_carts[] = {
+    { "Ace3DSPlus", makeSim<SimAce3DSPlus>, 0x200000, {0x1000}, false, 0x10800, 0x3000, 0x20000 },
+    { "r4isdhc", makeSim<SimR4iSDHC>, 0x200000, {0x1000}, false, 0x10800, 0x3000, 0x20000 },
+    { "ak2i", makeSim<SimAK2i>, 0x1000000, {0x10000}, true, 0x10000, 0x10000, 0x20000 },
+    { "R4iGold3DS", makeSim<SimR4iGold3DS>, 0x400000, {0x10000}, true, 0x10000, 0x10000, 0x20000 },
+    { "DSTT", makeSimDSTT<0xBA01>, 0x10000, {0x2000, 0x1000, 0x1000, 0x4000, 0x8000}, true, 0x2000, 0x2000, 0x8000 },
+    { "DSONE", makeSimDSTT<0xD7BF>, 0x80000, {0x1000}, true, 0x2000, 0x2000, 0x8000 },
+    { "DSONEi", makeSimDSTT<0xD7BF>, 0x400000, {0x10000}, true, 0, 0x2000, 0x8000 },
+};
+
+void fill(uint8_t *data, size_t size, uint32_t seed) {
+    for (size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+}
+
+const BenchBudget *findBudget(const BenchBudget *budgets, size_t count, const char *cart, const char *operation) {
+    for (size_t i = 0; i < count; ++i) {
+        if (!std::strcmp(budgets[i].cart, cart) && !std::strcmp(budgets[i].operation, operation)) {
+            return &budgets[i];
+        }
+    }
+    return nullptr;
+}
+
+Flashcart *findCart(const char *short_name) {
+    for (Flashcart *cart : *flashcart_list) {
+        if (!std::strcmp(cart->getShortName(), short_name)) {
+            return cart;
+        }
+    }
+    return nullptr;
+}
+
+/// Runs `operation`, then records and checks what it cost.
+template<typename Operation>
+bool bench(Flashcart *cart, SimCard &sim, const char *name, const BenchBudget *budgets, size_t budget_count,
+        std::vector<BenchResult> &results, Operation operation) {
+    cart->resetCounters();
+    const uint64_t start = sim.elapsed();
+    const bool ok = operation();
+    const FlashCounters &counters = cart->getCounters();
+
+    BenchResult result = { { cart->getShortName(), name, counters.commands, counters.erases,
+        counters.bytes_in + counters.bytes_out, sim.elapsed() - start }, ok, false };
+    logMessage(LOG_NOTICE, "bench: %s %s: %" PRIu32 " commands, %" PRIu32 " erases, %" PRIu64 " bytes, %" PRIu64 " us",
+        result.cost.cart, name, result.cost.commands, result.cost.erases, result.cost.bytes, result.cost.elapsed);
+
+    const BenchBudget *budget = findBudget(budgets, budget_count, result.cost.cart, name);
+    if (budget) {
+        result.over_budget = result.cost.commands > budget->commands || result.cost.erases > budget->erases
+            || result.cost.bytes > budget->bytes || result.cost.elapsed > budget->elapsed;
+    }
+    if (!ok) {
+        logMessage(LOG_ERR, "bench: %s %s failed", result.cost.cart, name);
+    } else if (result.over_budget) {
+        logMessage(LOG_ERR, "bench: %s %s is over its budget of %" PRIu32 " commands, %" PRIu32 " erases, %" PRIu64 " bytes, %" PRIu64 " us",
+            result.cost.cart, name, budget->commands, budget->erases, budget->bytes, budget->elapsed);
+    }
+
+    results.push_back(result);
+    return ok && !result.over_budget;
+}
+}
+
+bool runBenchmarks(const SimLatency &latency, const BenchBudget *budgets, size_t budget_count, std::vector<BenchResult> &results) {
+    bool passed = true;
+
+    for (const BenchCart &entry : bench_carts) {
+        Flashcart *cart = findCart(entry.cart);
+        if (!cart) {
+            continue;
+        }
+
+        NorFlash flash(entry.flash_size, entry.sectors);
+        fill(flash.data(), flash.size(), 1);
+        std::unique_ptr<SimCard> sim(entry.make(flash, latency));
+        cart->setBackend(sim.get());
+
+        if (entry.initialize) {
+            passed &= bench(cart, *sim, "initialize", budgets, budget_count, results, [&]() {
+                return cart->initialize(nullptr);
+            });
+        }
+
+        std::vector<uint8_t> data(cart->getMaxLength());
+        passed &= bench(cart, *sim, "read", budgets, budget_count, results, [&]() {
+            return cart->readFlash(0, static_cast<uint32_t>(data.size()), data.data());
+        });
+
+        fill(data.data(), entry.write_length, 2);
+        passed &= bench(cart, *sim, "write", budgets, budget_count, results, [&]() {
+            return cart->writeFlash(entry.write_address, entry.write_length, data.data());
+        });
+
+        std::vector<uint8_t> blowfish_key(0x1048), firm(entry.firm_size);
+        fill(blowfish_key.data(), blowfish_key.size(), 3);
+        fill(firm.data(), firm.size(), 4);
+        passed &= bench(cart, *sim, "inject", budgets, budget_count, results, [&]() {
+            return cart->injectNtrBoot(blowfish_key.data(), firm.data(), entry.firm_size);
+        });
+
+        cart->setBackend(nullptr);
+    }
+
+    for (Flashcart *cart : *flashcart_list) {
+        bool simulated = false;
+        for (const BenchCart &entry : bench_carts) {
+            simulated |= !std::strcmp(entry.cart, cart->getShortName());
+        }
+        if (!simulated) {
+            logMessage(LOG_INFO, "bench: %s has no simulator, skipped", cart->getShortName());
+        }
+    }
+
+    return passed;
+}
+}
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "sim_card.h"
+
+// Runs every cart in `flashcart_list` against its simulated cart, and checks what each
+// flash operation cost against a budget.
+namespace flashcart_core {
+namespace sim {
+/// What one operation cost, or may cost at most.
+struct BenchBudget {
+    const char *cart; // Short name
+    const char *operation; // "initialize", "read", "write" or "inject"
+    uint32_t commands;
+    uint32_t erases;
+    uint64_t bytes; // Sent and received, commands included
+    uint64_t elapsed; // Microseconds on the simulated cart's clock
+};
+
+struct BenchResult {
+    BenchBudget cost;
+    bool ok; // The operation succeeded
+    bool over_budget;
+};
+
+/// Runs `initialize`, a full `readFlash`, a partial `writeFlash` and `injectNtrBoot` for every
+/// cart with a simulator, logs what each cost, and appends it to `results`.
+///
+/// Returns false if an operation failed or went over its entry in `budgets`. Carts without
+/// a simulator, and `initialize` for carts that need key exchange, are skipped.
+bool runBenchmarks(const SimLatency &latency, const BenchBudget *budgets, size_t budget_count, std::vector<BenchResult> &results);
+}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "bench.h"
+
+// What `runBenchmarks` may cost per cart and operation before it fails, under `bench_latency`.
+//
+// The counts are measured with 2% headroom. A change that makes a driver cheaper
+// should lower its budget here, so a later regression doesn't go unnoticed.
+//
+// R4iSDHC.hk has no simulator, and so no budget: its reads and writes depend on the software
+// revision `initialize` reads after key exchange, which a simulated cart can't do.
+namespace flashcart_core {
+namespace sim {
+// Roughly a cart on a 3DS: commands in tens of microseconds, 4K to 64K sector erases in 50ms
+const SimLatency bench_latency = { 20, 1, 20, 50000 };
+
+const BenchBudget bench_budgets[] = {
+    { "Ace3DSPlus", "read", 523, 0, 2150000, 2160000 },
+    { "Ace3DSPlus", "write", 9490, 4, 65100, 255000 },
+    { "Ace3DSPlus", "inject", 102000, 43, 736000, 2780000 },
+    { "r4isdhc", "read", 535000, 0, 6420000, 17200000 },
+    { "r4isdhc", "write", 15900, 4, 190000, 712000 },
+    { "r4isdhc", "inject", 160000, 39, 1920000, 7110000 },
+    { "ak2i", "initialize", 7, 0, 58, 180 },
+    { "ak2i", "read", 33500, 0, 17400000, 18100000 },
+    { "ak2i", "write", 136000, 1, 1430000, 4140000 },
+    { "ak2i", "inject", 407000, 3, 4480000, 12700000 },
+    { "R4iGold3DS", "initialize", 3, 0, 25, 66 },
+    { "R4iGold3DS", "read", 16800, 0, 4450000, 4780000 },
+    { "R4iGold3DS", "write", 136000, 1, 1700000, 4410000 },
+    { "R4iGold3DS", "inject", 544000, 4, 7050000, 18000000 },
+    { "DSTT", "initialize", 13, 0, 147, 392 },
+    { "DSTT", "read", 16800, 0, 201000, 535000 },
+    { "DSTT", "write", 32400, 2, 389000, 1040000 },
+    { "DSTT", "inject", 219000, 4, 2630000, 7010000 },
+    { "DSONE", "initialize", 7, 0, 74, 196 },
+    { "DSONE", "read", 134000, 0, 1610000, 4280000 },
+    { "DSONE", "write", 69500, 16, 834000, 2230000 },
+    { "DSONE", "inject", 2950000, 1, 35400000, 94200000 },
+    { "DSONEi", "initialize", 7, 0, 74, 196 },
+    { "DSONEi", "read", 1070000, 0, 12900000, 34300000 },
+    { "DSONEi", "write", 45500, 1, 546000, 1460000 },
+    { "DSONEi", "inject", 23600000, 1, 283000000, 754000000 },
+};
+}
+}
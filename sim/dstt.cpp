@@ -0,0 +1,207 @@
+#include <cstring>
+
+#include "sim_card.h"
+
+namespace flashcart_core {
+namespace sim {
+// 87 AA AA AA AA DD DD 00 writes DDDD to the flash bus at AAAAAAAA, and
+// 00 AA AA AA AA 00 00 00 reads the 4 bytes at AAAAAAAA.
+ncgc::Err SimDSTT::sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) {
+    tick(8 + size);
+    if (buf) {
+        std::memset(buf, 0, size);
+    }
+
+    const uint32_t address = be32(cmd + 1);
+    switch (cmd[0]) {
+        case 0x87:
+            if (m_command_set == CommandSet::AMD) {
+                writeAMD(address, cmd[5] << 8 | cmd[6]);
+            } else {
+                writeIntel(address, cmd[5] << 8 | cmd[6]);
+            }
+            break;
+        case 0x00: {
+            const uint32_t word = readWord(address);
+            std::memcpy(buf, &word, std::min<size_t>(size, 4));
+            break;
+        }
+        case 0x86: // cart init and shutdown
+        case 0x88:
+            break;
+        default:
+            unknownCommand(cmd, 8);
+            break;
+    }
+
+    return ncgc::Err();
+}
+
+// How long an AMD chip waits for another sector address after each 0x30, before it starts erasing
+constexpr uint64_t erase_window = 50;
+
+void SimDSTT::writeAMD(uint32_t address, uint16_t data) {
+    // sector erases after the first are queued while the window is open; each sector takes
+    // as long to erase as it would on its own
+    if (m_mode == Mode::EraseQueue) {
+        m_mode = Mode::Read;
+        if (m_clock <= m_erase_window && (data & 0xFF) == 0x30) {
+            m_flash.erase(address);
+            m_ready += m_latency.erase;
+            m_erase_window = m_clock + erase_window;
+            m_mode = Mode::EraseQueue;
+            return;
+        }
+    }
+    // the chip ignores the bus until an erase or program finishes
+    if (busy()) {
+        return;
+    }
+    if (m_mode == Mode::Program) {
+        const uint8_t value = data & 0xFF;
+        program(address, &value, 1);
+        m_mode = Mode::Read;
+        return;
+    }
+    // unlock bypass: 0xA0 and the data program a byte, and 0x90 then 0x00 leave it; the
+    // chip takes nothing else, not even a reset
+    if (m_bypass) {
+        if ((data & 0xFF) == 0xA0) {
+            m_mode = Mode::Program;
+        } else if (m_cycle == 1 && (data & 0xFF) == 0x00) {
+            m_bypass = false;
+        }
+        m_cycle = (data & 0xFF) == 0x90 ? 1 : 0;
+        return;
+    }
+    if ((data & 0xFF) == 0xF0) {
+        m_mode = Mode::Read;
+        m_cycle = 0;
+        return;
+    }
+
+    switch (m_cycle) {
+        case 0:
+            m_cycle = (data & 0xFF) == 0xAA ? 1 : 0;
+            return;
+        case 1:
+            m_cycle = (data & 0xFF) == 0x55 ? 2 : 0;
+            return;
+    }
+
+    m_cycle = 0;
+    switch (data & 0xFF) {
+        case 0x90:
+            m_mode = Mode::Id;
+            break;
+        case 0xA0:
+            m_mode = Mode::Program;
+            break;
+        case 0x20:
+            m_bypass = m_unlock_bypass;
+            m_mode = Mode::Read;
+            break;
+        case 0x80:
+            m_mode = Mode::Erase;
+            break;
+        case 0x30:
+            if (m_mode == Mode::Erase) {
+                erase(address);
+                m_erase_window = m_clock + erase_window;
+                m_mode = Mode::EraseQueue;
+                break;
+            }
+            m_mode = Mode::Read;
+            break;
+        case 0x50:
+            // SST parts: the 64K block `address` is in
+            if (m_mode == Mode::Erase && (m_id & 0xFF) == 0xBF) {
+                const uint32_t block = address & ~0xFFFFu;
+                for (uint32_t at = block; at < block + 0x10000 && at < m_flash.size(); ) {
+                    uint32_t start, length;
+                    m_flash.sector(at, &start, &length);
+                    m_flash.erase(at);
+                    at = start + length;
+                }
+                m_ready = m_clock + m_latency.erase;
+            }
+            m_mode = Mode::Read;
+            break;
+        case 0x10:
+            // as long as erasing every sector one at a time
+            if (m_mode == Mode::Erase) {
+                m_flash.eraseAll();
+                m_ready = m_clock;
+                for (uint32_t at = 0; at < m_flash.size(); ) {
+                    uint32_t start, length;
+                    m_flash.sector(at, &start, &length);
+                    m_ready += m_latency.erase;
+                    at = start + length;
+                }
+            }
+            m_mode = Mode::Read;
+            break;
+        default:
+            m_mode = Mode::Read;
+            break;
+    }
+}
+
+void SimDSTT::writeIntel(uint32_t address, uint16_t data) {
+    if (m_mode == Mode::Program) {
+        const uint8_t value = data & 0xFF;
+        program(address, &value, 1);
+        m_mode = Mode::Status;
+        return;
+    }
+    if (m_mode == Mode::Erase) {
+        if ((data & 0xFF) == 0xD0) {
+            erase(address);
+        }
+        m_mode = Mode::Status;
+        return;
+    }
+
+    switch (data & 0xFF) {
+        case 0xFF:
+            m_mode = Mode::Read;
+            break;
+        case 0x70:
+            m_mode = Mode::Status;
+            break;
+        case 0x90:
+            m_mode = Mode::Id;
+            break;
+        case 0x40:
+        case 0x10:
+            m_mode = Mode::Program;
+            break;
+        case 0x20:
+            m_mode = Mode::Erase;
+            break;
+        // 0x50 clears the status register, which never has errors in it;
+        // anything else (like the AMD unlock cycles) is ignored
+    }
+}
+
+uint32_t SimDSTT::readWord(uint32_t address) {
+    if (m_mode == Mode::Id) {
+        // every sector reads as unprotected
+        return (address & 0xFF) == 2 ? 0 : m_id;
+    }
+    if (m_mode == Mode::Status) {
+        return busy() ? 0 : 0x80;
+    }
+
+    uint32_t word;
+    readFlash(address, &word, 4);
+    // AMD: until an erase or program finishes, each byte reads as status: DQ7 the inverse
+    // of the data's, DQ6 toggling, and DQ3 high once no more sector erases can be queued
+    if (m_command_set == CommandSet::AMD && busy()) {
+        m_toggle = !m_toggle;
+        return (~word & 0x80808080) | (m_toggle ? 0x40404040 : 0) | (m_clock > m_erase_window ? 0x08080808 : 0);
+    }
+    return word;
+}
+}
+}
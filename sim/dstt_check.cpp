@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "dstt_check.h"
+#include "sim_card.h"
+
+namespace flashcart_core {
+namespace sim {
+namespace {
+struct CheckChip {
+    const char *name; // The flashchip ID the driver reads
+    uint32_t id;
+    std::vector<uint32_t> sectors; // The first 64K of the chip's
+    SimDSTT::CommandSet command_set;
+    bool unlock_bypass;
+};
+
+const CheckChip check_chips[] = {
+    { "0xBA01", 0xBA01, {0x2000, 0x1000, 0x1000, 0x4000, 0x8000}, SimDSTT::CommandSet::AMD, true },
+    { "0xBA01, ignoring unlock bypass", 0xBA01, {0x2000, 0x1000, 0x1000, 0x4000, 0x8000}, SimDSTT::CommandSet::AMD, false },
+    { "0x051F", 0x051F, {0x4000, 0x2000, 0x2000, 0x8000}, SimDSTT::CommandSet::AMD, false },
+    { "0x041F", 0x041F, {0x10000}, SimDSTT::CommandSet::AMD, false },
+    { "0x80BF", 0x80BF, {0x800}, SimDSTT::CommandSet::AMD, false },
+    { "0x9789", 0x9789, {0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x8000},
+        SimDSTT::CommandSet::Intel, false },
+    { "0x9289", 0x9289, {0x8000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000},
+        SimDSTT::CommandSet::Intel, false },
+};
+
+const char *const write_kinds[] = { "random", "clearing bits", "unchanged" };
+
+Flashcart *findDSTT() {
+    for (Flashcart *cart : *flashcart_list) {
+        if (!std::strcmp(cart->getShortName(), "DSTT")) {
+            return cart;
+        }
+    }
+    return nullptr;
+}
+
+/// Runs the writes and injects for one chip; `flash` starts out random.
+bool checkChip(Flashcart *cart, const CheckChip &chip, uint32_t writes, uint32_t seed) {
+    const SimLatency latency = { 1, 0, 1, 10 };
+    NorFlash flash(0x10000, chip.sectors);
+    std::mt19937 rng(seed);
+    for (uint32_t i = 0; i < flash.size(); ++i) {
+        flash.data()[i] = rng();
+    }
+    std::vector<uint8_t> copy(flash.data(), flash.data() + flash.size());
+
+    std::unique_ptr<SimCard> sim(new SimDSTT(flash, latency, chip.id, chip.command_set, chip.unlock_bypass));
+    cart->setBackend(sim.get());
+    if (!cart->initialize(nullptr)) {
+        logMessage(LOG_ERR, "check: DSTT %s: initialize failed", chip.name);
+        cart->setBackend(nullptr);
+        return false;
+    }
+
+    const char *problem = nullptr;
+    std::vector<uint8_t> data;
+    for (uint32_t i = 0; i < writes && !problem; ++i) {
+        // word aligned, since the driver reads the flash a word at a time
+        uint32_t length = (1 + rng() % 0x3000 + 3) & ~3u;
+        const uint32_t address = (rng() % (flash.size() - length + 1)) & ~3u;
+        const unsigned int kind = rng() % 3;
+        data.resize(length);
+        for (uint32_t at = 0; at < length; ++at) {
+            const uint8_t was = copy[address + at];
+            data[at] = kind == 0 ? rng() : kind == 1 ? was & rng() : was;
+        }
+
+        const uint32_t erases_before = flash.erases, programs_before = flash.programs;
+        const uint32_t set_bits_before = flash.set_bits;
+        const bool written = cart->writeFlash(address, length, data.data());
+        std::copy(data.begin(), data.end(), copy.begin() + address);
+
+        problem = !written ? "write failed"
+            : std::memcmp(flash.data(), copy.data(), flash.size()) ? "flash differs from the copy"
+            : flash.set_bits != set_bits_before ? "programmed a cleared bit back to 1"
+            : kind == 2 && (flash.erases != erases_before || flash.programs != programs_before)
+                ? "erased or programmed flash that was already right"
+            : kind == 1 && flash.erases != erases_before ? "erased for a write that only clears bits"
+            : nullptr;
+        if (problem) {
+            logMessage(LOG_ERR, "check: DSTT %s, seed %" PRIu32 ", write %" PRIu32 ": %s", chip.name, seed, i, problem);
+            logMessage(LOG_ERR, "check: writing 0x%" PRIX32 " %s bytes at 0x%08" PRIX32, length, write_kinds[kind], address);
+        }
+    }
+
+    if (!problem) {
+        std::vector<uint8_t> blowfish_key(0x1048), firm(0x4000);
+        for (uint8_t &byte : blowfish_key) {
+            byte = rng();
+        }
+        for (uint8_t &byte : firm) {
+            byte = rng();
+        }
+        std::copy(blowfish_key.begin(), blowfish_key.begin() + 0x48, copy.begin() + 0x1000);
+        std::copy(blowfish_key.begin() + 0x48, blowfish_key.end(), copy.begin() + 0x2000);
+        std::copy(firm.begin(), firm.end(), copy.begin() + 0x7E00);
+
+        const bool injected = cart->injectNtrBoot(blowfish_key.data(), firm.data(), static_cast<uint32_t>(firm.size()));
+        const uint32_t erases_before = flash.erases, programs_before = flash.programs;
+        const bool reinjected = cart->injectNtrBoot(blowfish_key.data(), firm.data(), static_cast<uint32_t>(firm.size()));
+
+        problem = !injected || !reinjected ? "inject failed"
+            : std::memcmp(flash.data(), copy.data(), flash.size()) ? "flash differs from the copy after injecting"
+            : flash.erases != erases_before || flash.programs != programs_before
+                ? "second inject erased or programmed"
+            : nullptr;
+        if (problem) {
+            logMessage(LOG_ERR, "check: DSTT %s, seed %" PRIu32 ": %s", chip.name, seed, problem);
+        }
+    }
+
+    cart->setBackend(nullptr);
+    if (!problem) {
+        logMessage(LOG_NOTICE, "check: DSTT %s: %" PRIu32 " writes and an inject, %" PRIu32 " erases, %" PRIu32 " bytes programmed",
+            chip.name, writes, flash.erases, flash.programs);
+    }
+    return !problem;
+}
+}
+
+bool checkDSTT(uint32_t writes, uint32_t seed) {
+    Flashcart *const cart = findDSTT();
+    if (!cart) {
+        logMessage(LOG_ERR, "check: no DSTT driver");
+        return false;
+    }
+
+    bool passed = true;
+    for (const CheckChip &chip : check_chips) {
+        passed &= checkChip(cart, chip, writes, seed);
+    }
+
+    return passed;
+}
+}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+// Randomized check of the DSTT driver's sector-aware writes, over simulated flashchips.
+namespace flashcart_core {
+namespace sim {
+/// Writes `writes` random ranges through the DSTT driver, then injects ntrboot twice, for each
+/// of several AMD, SST, Atmel and Intel flashchips and their sector tables.
+///
+/// After every write, the whole chip must equal a copy with just the written bytes changed, so
+/// the rest of each erased sector has to have been put back. A write of what the flash already
+/// holds, and the second inject, must not erase or program anything. Returns false if any of
+/// that fails; the first bad write of each chip is logged with `seed`, so it can be run again.
+bool checkDSTT(uint32_t writes, uint32_t seed);
+}
+}
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "flash_util_check.h"
+#include "sim_card.h"
+#include "../flash_util.h"
+
+namespace flashcart_core {
+namespace sim {
+namespace {
+/// A cart that is nothing but a `NorFlash` behind `FlashUtil`, counting what it's asked to do.
+template<unsigned int readPower, unsigned int erasePower, unsigned int writePower, typename Sectors>
+class MemoryCart : Flashcart {
+    static constexpr uint32_t readSize = 1 << readPower;
+
+    NorFlash &m_flash;
+    const std::vector<uint32_t> m_sectors;
+    const SectorLayout m_layout;
+    std::vector<uint8_t> m_arena;
+
+    void touched(uint32_t start, uint32_t end) {
+        low = std::min(low, start);
+        high = std::max(high, end);
+    }
+
+    bool readPage(uint32_t address, uint32_t size, void *dest) {
+        if (readPower && size != readSize) {
+            ++bad_calls;
+            return false;
+        }
+
+        if (address < m_flash.size() && size <= m_flash.size() - address) {
+            std::memcpy(dest, m_flash.data() + address, size);
+            return true;
+        }
+
+        // reads of whole pages can run past the end of the flash, and wrap around like on the real thing
+        for (uint32_t i = 0; i < size; ++i) {
+            static_cast<uint8_t *>(dest)[i] = m_flash.read(address + i);
+        }
+        return true;
+    }
+
+    bool eraseSector(uint32_t address) {
+        const FlashSector sector = m_layout.find(address);
+        if (sector.start != address) {
+            ++bad_calls;
+            return false;
+        }
+
+        m_flash.erase(address);
+        touched(sector.start, sector.start + sector.size);
+        return true;
+    }
+
+    bool programPage(uint32_t address, const void *src) {
+        if (address % writeSize) {
+            ++bad_calls;
+            return false;
+        }
+
+        for (uint32_t i = 0; i < writeSize; ++i) {
+            m_flash.program(address + i, static_cast<const uint8_t *>(src)[i]);
+        }
+        ++pages;
+        touched(address, address + writeSize);
+        return true;
+    }
+
+public:
+    using Util = FlashUtil<MemoryCart, readPower, &MemoryCart::readPage, erasePower, &MemoryCart::eraseSector,
+        writePower, &MemoryCart::programPage, Sectors>;
+    friend Util;
+
+    static constexpr uint32_t writeSize = 1 << writePower;
+
+    uint32_t pages; // Write pages programmed
+    uint32_t bad_calls; // Calls that broke `FlashUtil`'s guarantees about size and alignment
+    uint32_t low, high; // Range of addresses erased or programmed
+
+    MemoryCart(NorFlash &flash, const std::vector<uint32_t> &sectors) : Flashcart("FlashUtil check", flash.size()),
+        m_flash(flash), m_sectors(sectors), m_layout{m_sectors.data(), m_sectors.size()}, m_arena(Util::scratchSize),
+        pages(0), bad_calls(0), low(UINT32_MAX), high(0) {}
+    // carts add themselves to `flashcart_list` for good, and this one is gone after the check
+    ~MemoryCart() {
+        flashcart_list->erase(std::find(flashcart_list->begin(), flashcart_list->end(), static_cast<Flashcart *>(this)));
+    }
+
+    bool initialize() override { return true; }
+    void shutdown() override {}
+    bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer) override {
+        return Util::read(this, address, length, buffer);
+    }
+    bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer) override {
+        return Util::write(this, address, length, buffer);
+    }
+    bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) override { return false; }
+    uint32_t getEraseSize() override { return Util::eraseSize; }
+    FlashSector getEraseSector(uint32_t address) override { return m_layout.find(address); }
+
+    /// Has `FlashUtil` work in the scratch arena, or in heap buffers.
+    void useArena(bool use) {
+        setScratchArena(use ? m_arena.data() : nullptr, use ? m_arena.size() : 0);
+    }
+};
+
+/// The fewest erases and page programs that turn `old` into `want`, both covering the sectors from `start` to `end`.
+template<uint32_t writeSize>
+void minimumCost(const SectorLayout &sectors, const uint8_t *old, const uint8_t *want, uint32_t start, uint32_t end,
+        uint32_t &erases, uint32_t &pages) {
+    erases = pages = 0;
+
+    for (uint32_t address = start; address < end; ) {
+        const FlashSector sector = sectors.find(address);
+        const uint8_t *const sector_old = old + (sector.start - start);
+        const uint8_t *const sector_want = want + (sector.start - start);
+
+        bool sets_bits = false;
+        for (uint32_t i = 0; i < sector.size; ++i) {
+            sets_bits |= (sector_want[i] & ~sector_old[i]) != 0;
+        }
+
+        erases += sets_bits;
+        for (uint32_t page = 0; page < sector.size; page += writeSize) {
+            // after an erase, the blank pages are already right
+            const uint8_t *const base = sets_bits ? nullptr : sector_old + page;
+            bool program = false;
+            for (uint32_t i = 0; i < writeSize; ++i) {
+                program |= sector_want[page + i] != (base ? base[i] : 0xFF);
+            }
+            pages += program;
+        }
+
+        address = sector.start + sector.size;
+    }
+}
+
+const char *const old_kinds[] = { "erased", "random", "mostly clear" };
+const char *const new_kinds[] = { "random", "erased", "unchanged", "clearing bits", "a few bytes changed", "zeroes" };
+
+template<unsigned int readPower, unsigned int erasePower, unsigned int writePower,
+    typename Sectors = UniformSectors<erasePower>>
+bool checkGeometry(const char *name, std::vector<uint32_t> sectors, uint64_t cases, uint32_t seed) {
+    using Cart = MemoryCart<readPower, erasePower, writePower, Sectors>;
+    constexpr uint32_t eraseSize = Cart::Util::eraseSize;
+    constexpr uint32_t writeSize = Cart::writeSize;
+
+    NorFlash flash(std::max<uint32_t>(0x40000, 8 * eraseSize), sectors);
+    Cart cart(flash, sectors);
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> old, want, data, readback;
+    uint64_t erases = 0, pages = 0;
+
+    for (uint64_t i = 0; i < cases; ++i) {
+        // mostly short and unaligned writes, some longer than a sector, a few empty
+        const uint32_t length = rng() % 64 == 0 ? 0
+            : rng() % 4 == 0 ? 1 + rng() % (2 * writeSize) : 1 + rng() % (3 * eraseSize);
+        uint32_t address = rng() % (flash.size() - length + 1);
+        switch (rng() % 4) {
+            case 0: // the start of a sector
+                address = cart.getEraseSector(address).start;
+                break;
+            case 1: // just before the end of one
+                address = cart.getEraseSector(address).start + cart.getEraseSector(address).size - 1 - rng() % writeSize;
+                break;
+        }
+        address = std::min(address, flash.size() - length);
+
+        // the sectors the write touches
+        const uint32_t start = cart.getEraseSector(address).start;
+        const FlashSector last = cart.getEraseSector(address + std::max<uint32_t>(length, 1) - 1);
+        const uint32_t end = last.start + last.size;
+
+        const unsigned int old_kind = rng() % 3;
+        for (uint32_t at = start, bits = 0; at < end; ++at, bits >>= 8) {
+            if (at % 4 == 0) {
+                bits = old_kind == 0 ? UINT32_MAX : old_kind == 1 ? rng() : rng() & rng() & rng();
+            }
+            flash.data()[at] = bits;
+        }
+        old.assign(flash.data() + start, flash.data() + end);
+
+        const unsigned int new_kind = rng() % 6;
+        data.resize(length);
+        for (uint32_t at = 0; at < length; ++at) {
+            const uint8_t was = old[address - start + at];
+            switch (new_kind) {
+                case 0: data[at] = rng(); break;
+                case 1: data[at] = 0xFF; break;
+                case 2: data[at] = was; break;
+                case 3: data[at] = was & rng(); break;
+                case 4: data[at] = rng() % 64 ? was : rng(); break;
+                default: data[at] = 0; break;
+            }
+        }
+        want = old;
+        std::copy(data.begin(), data.end(), want.begin() + (address - start));
+
+        uint32_t min_erases, min_pages;
+        const SectorLayout layout{sectors.data(), sectors.size()};
+        minimumCost<writeSize>(layout, old.data(), want.data(), start, end, min_erases, min_pages);
+
+        cart.useArena(i & 1);
+        const uint32_t erases_before = flash.erases, set_bits_before = flash.set_bits;
+        cart.pages = cart.bad_calls = 0;
+        cart.low = UINT32_MAX;
+        cart.high = 0;
+
+        const bool written = cart.writeFlash(address, length, data.data());
+        const uint32_t case_erases = flash.erases - erases_before;
+        readback.resize(length);
+        const bool read = cart.readFlash(address, length, readback.data());
+
+        const char *problem = !written ? "write failed"
+            : cart.bad_calls ? "bad erase, program or read call"
+            : std::memcmp(flash.data() + start, want.data(), end - start) ? "flash differs from the copy"
+            : cart.pages && (cart.low < start || cart.high > end) ? "touched another sector"
+            : flash.set_bits != set_bits_before ? "programmed a cleared bit back to 1"
+            : case_erases != min_erases ? "wrong number of erases"
+            : cart.pages != min_pages ? "wrong number of page programs"
+            : !read ? "read failed"
+            : std::memcmp(readback.data(), data.data(), length) ? "read differs from the copy"
+            : nullptr;
+        if (problem) {
+            logMessage(LOG_ERR, "check: %s, seed %" PRIu32 ", case %" PRIu64 ": %s", name, seed, i, problem);
+            logMessage(LOG_ERR, "check: writing 0x%" PRIX32 " bytes at 0x%08" PRIX32 ", %s over %s, %s arena: "
+                "%" PRIu32 " erases and %" PRIu32 " programs, at least %" PRIu32 " and %" PRIu32,
+                length, address, new_kinds[new_kind], old_kinds[old_kind], i & 1 ? "with" : "without",
+                case_erases, cart.pages, min_erases, min_pages);
+            return false;
+        }
+
+        erases += case_erases;
+        pages += cart.pages;
+    }
+
+    logMessage(LOG_NOTICE, "check: %s: %" PRIu64 " cases, %" PRIu64 " erases, %" PRIu64 " page programs, all minimal",
+        name, cases, erases, pages);
+    return true;
+}
+}
+
+bool checkFlashUtil(uint64_t cases, uint32_t seed) {
+    bool passed = true;
+
+    // the page sizes of the drivers on FlashUtil, and of byte-programming and 512 byte page parts
+    passed &= checkGeometry<0, 12, 8>("4K sectors, 256 byte pages", {0x1000}, cases, seed);
+    passed &= checkGeometry<2, 12, 8>("4K sectors, 256 byte pages, 4 byte reads", {0x1000}, cases, seed);
+    passed &= checkGeometry<2, 10, 0>("1K sectors, byte programs, 4 byte reads", {0x400}, cases, seed);
+    passed &= checkGeometry<9, 12, 9>("4K sectors, 512 byte pages and reads", {0x1000}, cases, seed);
+    passed &= checkGeometry<0, 16, 8, CartSectors<0x10000, 0x2000>>("bottom boot sectors, 256 byte pages", {0x4000, 0x2000, 0x2000, 0x8000, 0x10000}, cases, seed);
+
+    return passed;
+}
+}
+}
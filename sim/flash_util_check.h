@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+
+// Differential check of `FlashUtil` against a plain copy of the flash.
+namespace flashcart_core {
+namespace sim {
+/// Writes and reads back `cases` random (address, length, old contents, new contents) cases
+/// through `FlashUtil` for each of several page and sector geometries, over a `NorFlash`.
+///
+/// Every write must leave the flash equal to the copy, and must erase and program no more
+/// than it has to: it erases only the sectors where a bit goes from 0 to 1, programs only
+/// the non-blank pages of the sectors it erased, and programs only the changed pages of
+/// the other sectors. Returns false if any case breaks this; the first bad case of each
+/// geometry is logged with `seed`, so it can be run again.
+bool checkFlashUtil(uint64_t cases, uint32_t seed);
+}
+}
@@ -0,0 +1,55 @@
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "arena_check.h"
+#include "bench_budgets.h"
+#include "dstt_check.h"
+#include "flash_util_check.h"
+#include "microbench.h"
+
+// Runs the benchmarks and checks in sim/ on the host: `flashcart_sim [cases [seed]]`, where
+// `cases` is how many random writes `checkFlashUtil` makes for each geometry.
+namespace flashcart_core {
+namespace platform {
+int logMessage(log_priority priority, const char *fmt, ...) {
+    if (priority < LOG_NOTICE) {
+        return 0;
+    }
+
+    std::va_list args;
+    va_start(args, fmt);
+    const int result = std::vfprintf(priority >= LOG_WARN ? stderr : stdout, fmt, args);
+    va_end(args);
+    std::fputc('\n', priority >= LOG_WARN ? stderr : stdout);
+    return result;
+}
+
+// none of the simulated carts do key exchange
+auto getBlowfishKey(BlowfishKey key) -> const std::uint8_t(&)[0x1048] {
+    static const std::uint8_t blank[0x1048] = {};
+    return blank;
+}
+}
+}
+
+int main(int argc, char **argv) {
+    using namespace flashcart_core;
+    const uint64_t cases = argc > 1 ? std::strtoull(argv[1], nullptr, 0) : 10000;
+    const uint32_t seed = argc > 2 ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 0)) : 1;
+
+    std::vector<sim::BenchResult> bench_results;
+    bool passed = sim::runBenchmarks(sim::bench_latency, sim::bench_budgets,
+        sizeof(sim::bench_budgets) / sizeof(sim::bench_budgets[0]), bench_results);
+    passed &= sim::checkFlashUtil(cases, seed);
+    passed &= sim::checkDSTT(200, seed);
+    passed &= sim::checkScratchArena(seed);
+
+    std::vector<sim::MicrobenchResult> microbench_results;
+    passed &= sim::runMicrobenchmarks(200, microbench_results);
+
+    logMessage(passed ? LOG_NOTICE : LOG_ERR, "sim: %s, seed %" PRIu32, passed ? "passed" : "FAILED", seed);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
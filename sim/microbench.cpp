@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "microbench.h"
+#include "../device.h"
+#include "../kernels.h"
+
+namespace flashcart_core {
+namespace sim {
+namespace {
+// The kernels as they were when they were moved out of the drivers, to check them against.
+namespace reference {
+uint8_t r4iGoldEncrypt(uint8_t dec, uint32_t offset, int type) {
+    uint8_t enc = 0;
+    switch (type) {
+        case 1:
+        case 3:
+            if (dec & 0x01) enc |= 0x10;
+            if (dec & 0x02) enc |= 0x08;
+            if (dec & 0x04) enc |= 0x80;
+            if (dec & 0x08) enc |= 0x40;
+            if (dec & 0x10) enc |= 0x02;
+            if (dec & 0x20) enc |= 0x01;
+            if (dec & 0x40) enc |= 0x04;
+            if (dec & 0x80) enc |= 0x20;
+            return enc;
+        case 2:
+            enc = (offset % 256) + 9;
+            return enc ^ dec;
+    }
+    return enc;
+}
+
+uint8_t r4isdhchkEncrypt(uint8_t dec) {
+    uint8_t enc = 0;
+    if (dec & 0x01) enc |= 0x20;
+    if (dec & 0x02) enc |= 0x10;
+    if (dec & 0x04) enc |= 0x02;
+    if (dec & 0x08) enc |= 0x08;
+    if (dec & 0x10) enc |= 0x40;
+    if (dec & 0x20) enc |= 0x80;
+    if (dec & 0x40) enc |= 0x01;
+    if (dec & 0x80) enc |= 0x04;
+    enc ^= 0x98;
+    return enc;
+}
+
+uint8_t r4isdhchkDecrypt(uint8_t enc) {
+    uint8_t dec = 0;
+    enc ^= 0x98;
+    if (enc & 0x01) dec |= 0x40;
+    if (enc & 0x02) dec |= 0x04;
+    if (enc & 0x04) dec |= 0x80;
+    if (enc & 0x08) dec |= 0x08;
+    if (enc & 0x10) dec |= 0x02;
+    if (enc & 0x20) dec |= 0x01;
+    if (enc & 0x40) dec |= 0x10;
+    if (enc & 0x80) dec |= 0x20;
+    return dec;
+}
+
+void ace3dsplusEnableFlash(uint32_t *bufu32) {
+    uint8_t *buf = reinterpret_cast<uint8_t *>(bufu32);
+    uint32_t weird_sum = 0;
+    for (int i = 0; i < 32; ++i) {
+        if (buf[i + (0x200 - 32)] & 1) {
+            weird_sum |= (1 << (31 - i));
+        }
+    }
+    for (int i = 0; i < 0x200/4; ++i) {
+        if (i & 1) {
+            bufu32[i] <<= 1;
+        } else {
+            bufu32[i] >>= 1;
+        }
+    }
+    for (int i = 0; i < 0x200; ++i) {
+        uint32_t sum_lsl1 = weird_sum << 1;
+        if ((sum_lsl1 ^ weird_sum) & 0x8000) {
+            sum_lsl1 |= 1;
+        }
+        buf[i] = (sum_lsl1 & 0x8000) ? (buf[i] | 1) : (buf[i] & ~1);
+        weird_sum = sum_lsl1;
+    }
+}
+
+void ace3dsplusConfigMap(uint16_t *configMap) {
+    for (int i = 0; i < 8; ++i) {
+        configMap[i] = 0xA;
+    }
+    for (int i = 0; i < (0x4000/2) - 8; ++i) {
+        configMap[i+8] = 0xB+i;
+    }
+    std::memcpy(configMap + 0x2000, configMap, 0x2000*2);
+}
+}
+
+// Every kernel takes `size` bytes of `in` and writes its answer to `out`, which is also
+// `size` bytes. Kernels on two buffers take them as the two halves of `in`.
+typedef void (*KernelFn)(uint8_t *out, const uint8_t *in, uint32_t size);
+
+template<int type>
+void r4iGoldEncrypt(uint8_t *out, const uint8_t *in, uint32_t size) {
+    kernels::r4iGoldEncrypt(out, in, size, type);
+}
+
+template<int type>
+void referenceR4iGoldEncrypt(uint8_t *out, const uint8_t *in, uint32_t size) {
+    for (uint32_t i = 0; i < size; ++i) {
+        out[i] = reference::r4iGoldEncrypt(in[i], i, type);
+    }
+}
+
+template<uint8_t (*fn)(uint8_t)>
+void eachByte(uint8_t *out, const uint8_t *in, uint32_t size) {
+    for (uint32_t i = 0; i < size; ++i) {
+        out[i] = fn(in[i]);
+    }
+}
+
+void ace3dsplusEnableFlash(uint8_t *out, const uint8_t *in, uint32_t size) {
+    uint32_t block[0x200/4];
+    for (uint32_t i = 0; i < size; i += sizeof(block)) {
+        std::memcpy(block, in + i, sizeof(block));
+        kernels::ace3dsplusEnableFlash(block);
+        std::memcpy(out + i, block, sizeof(block));
+    }
+}
+
+void referenceAce3dsplusEnableFlash(uint8_t *out, const uint8_t *in, uint32_t size) {
+    uint32_t block[0x200/4];
+    for (uint32_t i = 0; i < size; i += sizeof(block)) {
+        std::memcpy(block, in + i, sizeof(block));
+        reference::ace3dsplusEnableFlash(block);
+        std::memcpy(out + i, block, sizeof(block));
+    }
+}
+
+template<void (*fn)(uint16_t *)>
+void configMap(uint8_t *out, const uint8_t *in, uint32_t size) {
+    uint16_t map[0x4000];
+    for (uint32_t i = 0; i < size; i += sizeof(map)) {
+        fn(map);
+        std::memcpy(out + i, map, sizeof(map));
+    }
+}
+
+// FlashUtil's checks, a write page at a time
+constexpr uint32_t page = 0x100;
+
+void isErased(uint8_t *out, const uint8_t *in, uint32_t size) {
+    for (uint32_t i = 0; i < size; i += page) {
+        out[i / page] = kernels::isErased(in + i, page);
+    }
+}
+
+void referenceIsErased(uint8_t *out, const uint8_t *in, uint32_t size) {
+    for (uint32_t i = 0; i < size; i += page) {
+        out[i / page] = std::count(in + i, in + i + page, 0xFF) == page;
+    }
+}
+
+void onlyClearsBits(uint8_t *out, const uint8_t *in, uint32_t size) {
+    for (uint32_t i = 0; i < size / 2; i += page) {
+        out[i / page] = kernels::onlyClearsBits(in + i, in + size / 2 + i, page);
+    }
+}
+
+void referenceOnlyClearsBits(uint8_t *out, const uint8_t *in, uint32_t size) {
+    for (uint32_t i = 0; i < size / 2; i += page) {
+        bool clears = true;
+        for (uint32_t j = 0; j < page; ++j) {
+            clears &= (in[size / 2 + i + j] | in[i + j]) == in[i + j];
+        }
+        out[i / page] = clears;
+    }
+}
+
+void copyIfChanged(uint8_t *out, const uint8_t *in, uint32_t size) {
+    std::memcpy(out, in, size / 2);
+    for (uint32_t i = 0; i < size / 2; i += page) {
+        out[size / 2 + i / page] = kernels::copyIfChanged(out + i, in + size / 2 + i, page);
+    }
+}
+
+void referenceCopyIfChanged(uint8_t *out, const uint8_t *in, uint32_t size) {
+    std::memcpy(out, in, size / 2);
+    for (uint32_t i = 0; i < size / 2; i += page) {
+        out[size / 2 + i / page] = !std::equal(in + i, in + i + page, in + size / 2 + i);
+        std::memcpy(out + i, in + size / 2 + i, page);
+    }
+}
+
+// The input each kernel is timed on: whatever makes it do the most work
+void randomInput(uint8_t *in, uint32_t size, uint32_t seed) {
+    for (uint32_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        in[i] = seed >> 16;
+    }
+}
+
+void erasedInput(uint8_t *in, uint32_t size, uint32_t seed) {
+    std::memset(in, 0xFF, size);
+}
+
+// second half clears bits of the first, so every byte gets checked
+void clearingInput(uint8_t *in, uint32_t size, uint32_t seed) {
+    randomInput(in, size, seed);
+    for (uint32_t i = 0; i < size / 2; ++i) {
+        in[size / 2 + i] &= in[i];
+    }
+}
+
+// halves differ only in the last byte of each page, so every byte gets compared and copied
+void lastByteChangedInput(uint8_t *in, uint32_t size, uint32_t seed) {
+    randomInput(in, size / 2, seed);
+    std::memcpy(in + size / 2, in, size / 2);
+    for (uint32_t i = page - 1; i < size / 2; i += page) {
+        in[size / 2 + i] ^= 1;
+    }
+}
+
+struct Kernel {
+    const char *name;
+    KernelFn run;
+    KernelFn reference;
+    void (*input)(uint8_t *in, uint32_t size, uint32_t seed);
+};
+
+const Kernel microbench_kernels[] = {
+    { "R4iGold3DS encrypt rev6-D", r4iGoldEncrypt<1>, referenceR4iGoldEncrypt<1>, randomInput },
+    { "R4iGold3DS encrypt rev4-5", r4iGoldEncrypt<2>, referenceR4iGoldEncrypt<2>, randomInput },
+    { "r4isdhc.hk encrypt", eachByte<kernels::r4isdhchkEncrypt>, eachByte<reference::r4isdhchkEncrypt>, randomInput },
+    { "r4isdhc.hk decrypt", eachByte<kernels::r4isdhchkDecrypt>, eachByte<reference::r4isdhchkDecrypt>, randomInput },
+    { "Ace3DSPlus cmdEnableFlash", ace3dsplusEnableFlash, referenceAce3dsplusEnableFlash, randomInput },
+    { "Ace3DSPlus config map", configMap<kernels::ace3dsplusConfigMap>, configMap<reference::ace3dsplusConfigMap>, randomInput },
+    { "FlashUtil isErased", isErased, referenceIsErased, erasedInput },
+    { "FlashUtil onlyClearsBits", onlyClearsBits, referenceOnlyClearsBits, clearingInput },
+    { "FlashUtil copyIfChanged", copyIfChanged, referenceCopyIfChanged, lastByteChangedInput },
+};
+
+constexpr uint32_t input_size = 0x10000;
+
+uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+}
+
+bool runMicrobenchmarks(uint32_t repeats, std::vector<MicrobenchResult> &results) {
+    std::vector<uint8_t> in(input_size), out(input_size), expected(input_size);
+    bool passed = true;
+
+    for (const Kernel &kernel : microbench_kernels) {
+        // on random input first, then on what it's timed on
+        MicrobenchResult result = { kernel.name, uint64_t(repeats) * input_size, 0, 0, true };
+        for (int pass = 0; pass < 2; ++pass) {
+            (pass ? kernel.input : randomInput)(in.data(), input_size, 1);
+            std::fill(out.begin(), out.end(), 0);
+            std::fill(expected.begin(), expected.end(), 0);
+            kernel.run(out.data(), in.data(), input_size);
+            kernel.reference(expected.data(), in.data(), input_size);
+            result.ok &= out == expected;
+        }
+
+        // so the compiler can't drop the runs
+        volatile uint8_t sink = 0;
+        const auto start = std::chrono::steady_clock::now();
+        const uint64_t start_cycles = cycles();
+        for (uint32_t i = 0; i < repeats; ++i) {
+            kernel.run(out.data(), in.data(), input_size);
+            sink = sink + out[i % input_size];
+        }
+        const uint64_t elapsed_cycles = cycles() - start_cycles;
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+        if (result.bytes) {
+            result.ns_per_byte = elapsed.count() / result.bytes;
+            result.cycles_per_byte = double(elapsed_cycles) / result.bytes;
+        }
+        logMessage(LOG_NOTICE, "microbench: %s: %.3f ns/byte, %.3f cycles/byte", kernel.name,
+            result.ns_per_byte, result.cycles_per_byte);
+        if (!result.ok) {
+            logMessage(LOG_ERR, "microbench: %s doesn't match the reference implementation", kernel.name);
+        }
+
+        passed &= result.ok;
+        results.push_back(result);
+    }
+
+    return passed;
+}
+}
+}
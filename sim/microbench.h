@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Times the CPU-side loops in kernels.h on the host.
+namespace flashcart_core {
+namespace sim {
+struct MicrobenchResult {
+    const char *kernel;
+    uint64_t bytes; // Input bytes processed in the timed runs
+    double ns_per_byte;
+    double cycles_per_byte; // From the time-stamp counter; 0 on hosts without one
+    bool ok; // The output matched the implementation the kernel started out as
+};
+
+/// Runs every kernel `repeats` times over 64K of its worst-case input, logs what each took per
+/// byte, and appends it to `results`.
+///
+/// Each kernel is first checked against a copy of the code it started out as, on random
+/// input and on the timed input. Returns false if any of them gave a different answer.
+bool runMicrobenchmarks(uint32_t repeats, std::vector<MicrobenchResult> &results);
+}
+}
@@ -0,0 +1,47 @@
+#include <cstring>
+
+#include "sim_card.h"
+
+namespace flashcart_core {
+namespace sim {
+ncgc::Err SimR4iGold3DS::sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) {
+    tick(8 + size);
+    if (buf) {
+        std::memset(buf, 0, size);
+    }
+
+    const uint32_t address = be24(cmd + 1);
+    switch (cmd[0]) {
+        case 0xD1: // hardware revision
+            std::memcpy(buf, &m_hw_revision, std::min<size_t>(size, 4));
+            break;
+        case 0xC7: // card type
+            std::memcpy(buf, &m_hw_type, std::min<size_t>(size, 4));
+            break;
+        case 0xC0: { // flash busy
+            const uint32_t state = busy() ? 1 : 0;
+            std::memcpy(buf, &state, std::min<size_t>(size, 4));
+            break;
+        }
+        case 0xA5:
+            readFlash(address, buf, size);
+            break;
+        case 0xDA:
+            if (busy()) {
+                break;
+            }
+            if (cmd[5] == 0xA5) {
+                erase(address);
+            } else if (cmd[5] == 0x5A) {
+                program(address, cmd + 4, 1);
+            }
+            break;
+        default:
+            unknownCommand(cmd, 8);
+            break;
+    }
+
+    return ncgc::Err();
+}
+}
+}
@@ -0,0 +1,71 @@
+#include <cstring>
+
+#include "sim_card.h"
+
+namespace flashcart_core {
+namespace sim {
+// Commands are 99 XY CC AA AA AA D1 D2, X and Y being the SPI bytes out and in; page
+// program data follows in 99 00 D1 D2 commands, ended by 99 F0.
+ncgc::Err SimR4iSDHC::sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) {
+    tick(8 + size);
+    if (buf) {
+        std::memset(buf, 0, size);
+    }
+    if (cmd[0] != 0x99) {
+        unknownCommand(cmd, 8);
+        return ncgc::Err();
+    }
+
+    if (cmd[1] == 0) {
+        if (!m_page.empty()) {
+            m_page.push_back(cmd[2]);
+            m_page.push_back(cmd[3]);
+        }
+        return ncgc::Err();
+    }
+    if (cmd[1] == 0xF0) {
+        const size_t length = std::min<size_t>(m_page.size(), 0x100);
+        for (size_t i = 0; i < length; ++i) {
+            m_flash.program((m_page_address & ~0xFFu) | ((m_page_address + i) & 0xFF), m_page[i]);
+        }
+        if (length) {
+            m_clock += m_latency.program;
+        }
+        m_page.clear();
+        m_write_enabled = false;
+        return ncgc::Err();
+    }
+
+    const uint32_t address = be24(cmd + 3);
+    switch (cmd[2]) {
+        case 0x3B: // dual output read
+            readFlash(address, buf, std::min<size_t>(size, 4));
+            break;
+        case 0x06: // WREN
+            m_write_enabled = true;
+            break;
+        case 0x04: // WRDI
+            m_write_enabled = false;
+            break;
+        case 0x20: // SE, 4K
+            if (m_write_enabled) {
+                m_flash.erase(address);
+                m_clock += m_latency.erase;
+            }
+            m_write_enabled = false;
+            break;
+        case 0x02: // PP
+            if (m_write_enabled) {
+                m_page_address = address;
+                m_page.assign(cmd + 6, cmd + 8);
+            }
+            break;
+        default:
+            unknownCommand(cmd, 8);
+            break;
+    }
+
+    return ncgc::Err();
+}
+}
+}
@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <cstring>
+
+#include "sim_card.h"
+
+namespace flashcart_core {
+namespace sim {
+NorFlash::NorFlash(uint32_t size, std::vector<uint32_t> sectors)
+    : erases(0), programs(0), set_bits(0), m_data(size, 0xFF), m_sectors(std::move(sectors)) {
+    if (m_sectors.empty()) {
+        m_sectors.push_back(size);
+    }
+}
+
+void NorFlash::program(uint32_t address, uint8_t value) {
+    uint8_t &byte = m_data[address % m_data.size()];
+    if (value & ~byte) {
+        ++set_bits;
+    }
+    byte &= value;
+    ++programs;
+}
+
+void NorFlash::erase(uint32_t address) {
+    uint32_t start, length;
+    sector(address, &start, &length);
+    std::memset(m_data.data() + start, 0xFF, length);
+    ++erases;
+}
+
+void NorFlash::eraseAll() {
+    std::memset(m_data.data(), 0xFF, m_data.size());
+    ++erases;
+}
+
+void NorFlash::sector(uint32_t address, uint32_t *start, uint32_t *length) const {
+    address %= m_data.size();
+    uint32_t at = 0;
+    for (std::size_t i = 0; ; i = std::min(i + 1, m_sectors.size() - 1)) {
+        const uint32_t sector_size = std::min<uint32_t>(m_sectors[i], size() - at);
+        if (address < at + sector_size) {
+            *start = at;
+            *length = sector_size;
+            return;
+        }
+        at += sector_size;
+    }
+}
+
+ncgc::Err SimCard::sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) {
+    tick(8 + size);
+    unknownCommand(cmd, 8);
+    if (buf) {
+        std::memset(buf, 0xFF, size);
+    }
+    return ncgc::Err();
+}
+
+ncgc::Err SimCard::sendWriteCommand(const uint8_t *cmd, const void *buf, size_t size, uint32_t flags) {
+    tick(8 + size);
+    unknownCommand(cmd, 8);
+    return ncgc::Err();
+}
+
+ncgc::Err SimCard::sendSpi(const uint8_t *cmd, size_t cmd_length, uint8_t *resp, size_t resp_length) {
+    tick(cmd_length + resp_length);
+    unknownCommand(cmd, cmd_length);
+    if (resp) {
+        std::memset(resp, 0xFF, resp_length);
+    }
+    return ncgc::Err();
+}
+
+ncgc::Err SimCard::readData(uint32_t address, void *buf, size_t size) {
+    tick(size);
+    readFlash(address, buf, size);
+    return ncgc::Err();
+}
+
+void SimCard::unknownCommand(const uint8_t *cmd, size_t cmd_length) {
+    char hex[2 * 8 + 1] = "";
+    for (size_t i = 0; i < cmd_length && i < 8; ++i) {
+        std::snprintf(hex + 2 * i, 3, "%02X", cmd[i]);
+    }
+    logMessage(LOG_DEBUG, "sim: unknown command %s", hex);
+}
+
+void SimCard::readFlash(uint32_t address, void *buf, size_t size) {
+    if (!buf) {
+        return;
+    }
+    uint8_t *bytes = static_cast<uint8_t *>(buf);
+    for (size_t i = 0; i < size; ++i) {
+        bytes[i] = m_flash.read(address + i);
+    }
+}
+}
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "../device.h"
+
+// Simulated carts, to run the drivers without one: `Flashcart::setBackend(&sim)`.
+//
+// Each one speaks the protocol of the driver it's named after, on top of a `NorFlash`,
+// and keeps a virtual clock from a `SimLatency` instead of sleeping.
+namespace flashcart_core {
+namespace sim {
+/// NOR flash contents, with the rules of the real thing: programming only clears bits,
+/// and erasing sets a whole sector back to 0xFF.
+class NorFlash {
+public:
+    /// `sectors` are the sector sizes from address 0; the last one repeats up to `size`.
+    NorFlash(uint32_t size, std::vector<uint32_t> sectors);
+
+    uint32_t size() const { return static_cast<uint32_t>(m_data.size()); }
+    uint8_t *data() { return m_data.data(); }
+    const uint8_t *data() const { return m_data.data(); }
+
+    uint8_t read(uint32_t address) const { return m_data[address % m_data.size()]; }
+    /// Clears the bits of `address` that are clear in `value`.
+    void program(uint32_t address, uint8_t value);
+    /// Erases the sector `address` is in.
+    void erase(uint32_t address);
+    void eraseAll();
+
+    /// Finds the sector `address` is in.
+    void sector(uint32_t address, uint32_t *start, uint32_t *length) const;
+
+    uint32_t erases; // Sectors erased
+    uint32_t programs; // Bytes programmed
+    uint32_t set_bits; // Bytes programmed that asked for a cleared bit to be set again
+
+private:
+    std::vector<uint8_t> m_data;
+    std::vector<uint32_t> m_sectors;
+};
+
+/// How long the simulated cart takes, in microseconds of the virtual clock.
+struct SimLatency {
+    uint64_t command; // Each card command or SPI transfer
+    uint64_t byte; // Each byte transferred
+    uint64_t program; // Programming a byte or a page
+    uint64_t erase; // Erasing a sector
+};
+
+/// Base of the simulated carts: the virtual clock, and a busy flash.
+class SimCard : public CardBackend {
+public:
+    SimCard(NorFlash &flash, const SimLatency &latency) : m_flash(flash), m_latency(latency), m_clock(0), m_ready(0) {}
+
+    /// Microseconds the cart would have taken so far.
+    uint64_t elapsed() const { return m_clock; }
+
+    // Calls a cart doesn't know are logged, and answered with 0xFF.
+    ncgc::Err sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) override;
+    ncgc::Err sendWriteCommand(const uint8_t *cmd, const void *buf, size_t size, uint32_t flags) override;
+    ncgc::Err sendSpi(const uint8_t *cmd, size_t cmd_length, uint8_t *resp, size_t resp_length) override;
+    ncgc::Err readData(uint32_t address, void *buf, size_t size) override;
+
+protected:
+    NorFlash &m_flash;
+    SimLatency m_latency;
+    uint64_t m_clock;
+    uint64_t m_ready; // When the flash finishes its erase or program
+
+    /// Advances the clock for one call transferring `bytes`.
+    void tick(size_t bytes) { m_clock += m_latency.command + m_latency.byte * bytes; }
+    bool busy() const { return m_clock < m_ready; }
+    void erase(uint32_t address) {
+        m_flash.erase(address);
+        m_ready = m_clock + m_latency.erase;
+    }
+    void program(uint32_t address, const uint8_t *data, uint32_t length) {
+        for (uint32_t i = 0; i < length; ++i) {
+            m_flash.program(address + i, data[i]);
+        }
+        m_ready = m_clock + m_latency.program;
+    }
+    void readFlash(uint32_t address, void *buf, size_t size);
+    /// Logs a call the cart doesn't know.
+    void unknownCommand(const uint8_t *cmd, size_t cmd_length);
+
+    static uint32_t be24(const uint8_t *bytes) { return bytes[0] << 16 | bytes[1] << 8 | bytes[2]; }
+    static uint32_t be32(const uint8_t *bytes) { return static_cast<uint32_t>(bytes[0]) << 24 | be24(bytes + 1); }
+};
+
+/// Ace3DSPlus: a 25-series SPI flash with 4K sectors and 256 byte pages.
+class SimAce3DSPlus : public SimCard {
+public:
+    SimAce3DSPlus(NorFlash &flash, const SimLatency &latency, uint32_t jedec_id = 0x1540EF)
+        : SimCard(flash, latency), m_jedec_id(jedec_id), m_write_enabled(false) {}
+
+    ncgc::Err sendSpi(const uint8_t *cmd, size_t cmd_length, uint8_t *resp, size_t resp_length) override;
+
+private:
+    uint32_t m_jedec_id;
+    bool m_write_enabled;
+};
+
+/// R4iSDHC: SPI NOR behind the cart's 0x99 commands, with 4K sectors and 256 byte pages.
+/// It has no status to poll, so the driver's delays are taken to cover the flash's.
+class SimR4iSDHC : public SimCard {
+public:
+    SimR4iSDHC(NorFlash &flash, const SimLatency &latency)
+        : SimCard(flash, latency), m_write_enabled(false), m_page_address(0) {
+        // so the simulator doesn't show up in `checkScratchArena`'s count of the driver's allocations
+        m_page.reserve(0x100);
+    }
+
+    ncgc::Err sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) override;
+
+private:
+    bool m_write_enabled;
+    uint32_t m_page_address;
+    std::vector<uint8_t> m_page; // Page program data sent so far
+};
+
+/// DSTT, DSONE and DSONEi: a parallel NOR behind the cart's 0x87 (write) and 0x00 (read)
+/// commands, with either the AMD or the Intel command set.
+class SimDSTT : public SimCard {
+public:
+    enum class CommandSet { AMD, Intel };
+
+    /// `id` is what the driver reads in autoselect mode; the manufacturer in its low byte.
+    /// `unlock_bypass` is whether an AMD chip takes the unlock bypass commands, or ignores them.
+    SimDSTT(NorFlash &flash, const SimLatency &latency, uint32_t id, CommandSet command_set = CommandSet::AMD,
+            bool unlock_bypass = true)
+        : SimCard(flash, latency), m_id(id), m_command_set(command_set), m_unlock_bypass(unlock_bypass),
+          m_mode(Mode::Read), m_cycle(0), m_bypass(false), m_toggle(false), m_erase_window(0) {}
+
+    ncgc::Err sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) override;
+
+private:
+    enum class Mode { Read, Id, Program, Erase, EraseQueue, Status };
+
+    uint32_t m_id;
+    CommandSet m_command_set;
+    bool m_unlock_bypass;
+    Mode m_mode;
+    uint32_t m_cycle; // AMD: how far into an unlock sequence the bus writes are
+    bool m_bypass; // AMD: in unlock bypass mode
+    bool m_toggle; // AMD: DQ6, which toggles on every read while the chip is busy
+    uint64_t m_erase_window; // AMD: until when more sector erases can be queued
+
+    void writeAMD(uint32_t address, uint16_t data);
+    void writeIntel(uint32_t address, uint16_t data);
+    uint32_t readWord(uint32_t address);
+};
+
+/// Acekard 2i: 64K sectors behind the cart's 0xB7 read and 0xD4 erase and byte program commands.
+class SimAK2i : public SimCard {
+public:
+    /// `hw_revision` is 0x44444444 or 0x81818181.
+    SimAK2i(NorFlash &flash, const SimLatency &latency, uint32_t hw_revision = 0x81818181)
+        : SimCard(flash, latency), m_hw_revision(hw_revision), m_unlocked(false) {}
+
+    ncgc::Err sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) override;
+
+private:
+    uint32_t m_hw_revision;
+    bool m_unlocked;
+};
+
+/// R4i Gold 3DS: 64K sectors behind the cart's 0xA5 read and 0xDA erase and byte program commands.
+class SimR4iGold3DS : public SimCard {
+public:
+    /// `hw_revision` and `hw_type` are what the cart answers 0xD1 and 0xC7 with.
+    SimR4iGold3DS(NorFlash &flash, const SimLatency &latency, uint32_t hw_revision = 0xA5A5A5A5, uint32_t hw_type = 0)
+        : SimCard(flash, latency), m_hw_revision(hw_revision), m_hw_type(hw_type) {}
+
+    ncgc::Err sendCommand(const uint8_t *cmd, void *buf, size_t size, uint32_t flags) override;
+
+private:
+    uint32_t m_hw_revision;
+    uint32_t m_hw_type;
+};
+}
+}
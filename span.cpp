@@ -0,0 +1,66 @@
+#include <cinttypes>
+#include <cstdio>
+
+#include "device.h"
+
+#ifndef FLASHCART_CORE_SPANS_CAPACITY
+#define FLASHCART_CORE_SPANS_CAPACITY 4096
+#endif
+
+namespace flashcart_core {
+namespace {
+#ifdef FLASHCART_CORE_SPANS
+struct SpanRecord {
+    const char *name;
+    std::uint64_t start;
+    std::uint64_t end;
+};
+
+SpanRecord spans[FLASHCART_CORE_SPANS_CAPACITY];
+std::uint32_t span_count = 0;
+std::uint32_t spans_dropped = 0;
+#endif
+
+bool writeString(TraceStream &out, const char *str) {
+    return out.write(str, std::strlen(str));
+}
+}
+
+#ifdef FLASHCART_CORE_SPANS
+Span::~Span() {
+    if (span_count == FLASHCART_CORE_SPANS_CAPACITY) {
+        ++spans_dropped;
+        return;
+    }
+
+    spans[span_count++] = { m_name, m_start, platform::now() };
+}
+#endif
+
+bool exportSpans(TraceStream &out) {
+    if (!writeString(out, "{\"traceEvents\":[")) {
+        return false;
+    }
+
+#ifdef FLASHCART_CORE_SPANS
+    // spans are recorded as they end, so children come before their parents;
+    // the trace viewer nests them by time anyway
+    char event[128];
+    for (std::uint32_t i = 0; i < span_count; ++i) {
+        std::snprintf(event, sizeof(event), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 "}",
+            i ? "," : "", spans[i].name, spans[i].start, spans[i].end - spans[i].start);
+        if (!writeString(out, event)) {
+            return false;
+        }
+    }
+
+    if (spans_dropped) {
+        logMessage(LOG_WARN, "exportSpans: %u spans didn't fit and were dropped", spans_dropped);
+    }
+    span_count = 0;
+    spans_dropped = 0;
+#endif
+
+    return writeString(out, "]}\n");
+}
+}
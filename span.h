@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+
+#include "platform.h"
+
+namespace flashcart_core {
+class TraceStream;
+
+/// Writes the spans recorded so far to `out` as Chrome trace-event JSON, and forgets them.
+///
+/// Without FLASHCART_CORE_SPANS nothing is ever recorded, and this writes an empty trace.
+bool exportSpans(TraceStream &out);
+
+#ifdef FLASHCART_CORE_SPANS
+/// Times the scope it lives in with `platform::now()`. Use `FLASH_SPAN` rather than this.
+class Span {
+public:
+    explicit Span(const char *name) : m_name(name), m_start(platform::now()) { }
+    ~Span();
+
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+
+private:
+    const char *m_name;
+    std::uint64_t m_start;
+};
+
+#define FLASH_SPAN_NAME2(line) flash_span_##line
+#define FLASH_SPAN_NAME(line) FLASH_SPAN_NAME2(line)
+// Times the rest of the enclosing scope as a span called `name`, which must be a string literal.
+#define FLASH_SPAN(name) ::flashcart_core::Span FLASH_SPAN_NAME(__LINE__)(name)
+#else
+#define FLASH_SPAN(name) do { } while (0)
+#endif
+}